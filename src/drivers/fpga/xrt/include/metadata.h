@@ -100,6 +100,7 @@
 #define XRT_MD_NODE_DDR_SRSR "drv_ep_ddr_srsr"
 #define XRT_MD_NODE_FLASH_VSEC "drv_ep_card_flash_program_00"
 #define XRT_MD_NODE_GOLDEN_VER "drv_ep_golden_ver_00"
+#define XRT_MD_NODE_MAILBOX_LOOPBACK "drv_ep_mailbox_loopback_00"
 #define XRT_MD_NODE_MAILBOX_VSEC "ep_mailbox_vsec_00"
 #define XRT_MD_NODE_MGMT_MAIN "drv_ep_mgmt_main_00"
 #define XRT_MD_NODE_PLAT_INFO "drv_ep_platform_info_mgmt_00"
@@ -215,6 +215,7 @@ void xleaf_get_barres(struct platform_device *pdev,
 void xleaf_get_root_id(struct platform_device *pdev,
 		       unsigned short *vendor, unsigned short *device,
 		       unsigned short *subvendor, unsigned short *subdevice);
+int xleaf_get_irq(struct platform_device *pdev, u32 vector);
 struct device *xleaf_register_hwmon(struct platform_device *pdev,
 				    const char *name, void *drvdata,
 				    const struct attribute_group **grps);
@@ -10,6 +10,10 @@
 #define _XRT_MAILBOX_H_
 
 #include "xleaf.h"
+
+/* Msg compression (XCL_MB_PEER_MSG_COMPRESS) is only offered if kernel has LZ4. */
+#define XRT_MAILBOX_LZ4	(IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS))
+
 /*
  * Mailbox IP driver leaf calls.
  */
@@ -17,8 +21,12 @@ enum xrt_mailbox_leaf_cmd {
 	XRT_MAILBOX_POST = XRT_XLEAF_CUSTOM_BASE, /* See comments in xleaf.h */
 	XRT_MAILBOX_REQUEST,
 	XRT_MAILBOX_LISTEN,
+	XRT_MAILBOX_REQUEST_ASYNC,
+	XRT_MAILBOX_SET_CONN_FLAGS,
+	XRT_MAILBOX_REFUSE,
 };
 
+/* Also used by XRT_MAILBOX_REFUSE, which only looks at req ID and channel. */
 struct xrt_mailbox_post {
 	u64 xmip_req_id; /* 0 means response */
 	bool xmip_sw_ch;
@@ -28,7 +36,7 @@ struct xrt_mailbox_post {
 
 struct xrt_mailbox_request {
 	bool xmir_sw_ch;
-	u32 xmir_resp_ttl;
+	u32 xmir_resp_timeout_ms;
 	void *xmir_req;
 	size_t xmir_req_size;
 	void *xmir_resp;
@@ -37,9 +45,37 @@ struct xrt_mailbox_request {
 
 typedef	void (*mailbox_msg_cb_t)(void *arg, void *data, size_t len,
 	u64 msgid, int err, bool sw_ch);
+/* Replaces the only listener, the one being replaced is returned in xmil_prev_*. */
 struct xrt_mailbox_listen {
 	mailbox_msg_cb_t xmil_cb;
 	void *xmil_cb_arg;
+	mailbox_msg_cb_t xmil_prev_cb; /* out */
+	void *xmil_prev_cb_arg; /* out */
+};
+
+/* Connection flags (XCL_MB_PEER_*) agreed on with peer at user probe. */
+struct xrt_mailbox_conn {
+	u64 xmic_conn_flags;
+};
+
+/*
+ * Same as xrt_mailbox_request, but returns once the request is queued. The
+ * response, or error, is passed to xmira_cb later along with xmira_req_id,
+ * which is returned on submission. Request is copied, but response buffer has
+ * to stay valid until xmira_cb is called. Time out counts from the moment
+ * the request is sent to peer.
+ * xmira_cb is called from mailbox thread and must not block on mailbox.
+ */
+struct xrt_mailbox_request_async {
+	bool xmira_sw_ch;
+	u32 xmira_resp_timeout_ms;
+	void *xmira_req;
+	size_t xmira_req_size;
+	void *xmira_resp;
+	size_t xmira_resp_size;
+	mailbox_msg_cb_t xmira_cb;
+	void *xmira_cb_arg;
+	u64 xmira_req_id; /* out */
 };
 
 #endif	/* _XRT_MAILBOX_H_ */
@@ -40,6 +40,7 @@ enum xrt_root_cmd {
 	/* Device info. */
 	XRT_ROOT_GET_RESOURCE,
 	XRT_ROOT_GET_ID,
+	XRT_ROOT_GET_IRQ,
 
 	/* Misc. */
 	XRT_ROOT_HOT_RESET,
@@ -82,6 +83,11 @@ struct xrt_root_get_id {
 	unsigned short  xpigi_sub_device_id;
 };
 
+struct xrt_root_get_irq {
+	u32 xpigq_vector; /* MSI-X vector index as in metadata */
+	int xpigq_irq; /* Linux IRQ number mapped to the vector */
+};
+
 struct xrt_root_hwmon {
 	bool xpih_register;
 	const char *xpih_name;
@@ -853,6 +853,15 @@ void xleaf_get_root_id(struct platform_device *pdev, unsigned short *vendor, uns
 		*subdevice = id.xpigi_sub_device_id;
 }
 
+int xleaf_get_irq(struct platform_device *pdev, u32 vector)
+{
+	struct xrt_root_get_irq irq = { vector, };
+	int rc = xrt_subdev_root_request(pdev, XRT_ROOT_GET_IRQ, &irq);
+
+	return rc ? rc : irq.xpigq_irq;
+}
+EXPORT_SYMBOL_GPL(xleaf_get_irq);
+
 struct device *xleaf_register_hwmon(struct platform_device *pdev, const char *name, void *drvdata,
 				    const struct attribute_group **grps)
 {
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Xilinx Alveo FPGA Mailbox IP Leaf Driver Tracepoints
+ *
+ * Copyright (C) 2021 Xilinx, Inc.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xrt_mailbox
+
+#if !defined(_XRT_MAILBOX_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _XRT_MAILBOX_TRACE_H_
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(xrt_mbx_msg,
+	TP_PROTO(struct device *dev, bool tx, u64 req_id, size_t len, u32 flags, u32 opcode),
+	TP_ARGS(dev, tx, req_id, len, flags, opcode),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(bool, tx)
+		__field(u64, req_id)
+		__field(size_t, len)
+		__field(u32, flags)
+		__field(u32, opcode)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->tx = tx;
+		__entry->req_id = req_id;
+		__entry->len = len;
+		__entry->flags = flags;
+		__entry->opcode = opcode;
+	),
+	TP_printk("%s %s id=0x%llx len=%zu flags=0x%x op=%u",
+		  __get_str(dev), __entry->tx ? "tx" : "rx", __entry->req_id,
+		  __entry->len, __entry->flags, __entry->opcode)
+);
+
+/* Msg is queued up on the channel. */
+DEFINE_EVENT(xrt_mbx_msg, xrt_mbx_msg_enqueue,
+	TP_PROTO(struct device *dev, bool tx, u64 req_id, size_t len, u32 flags, u32 opcode),
+	TP_ARGS(dev, tx, req_id, len, flags, opcode)
+);
+
+/* Msg is taken off the queue, its first pkt is being sent or received. */
+DEFINE_EVENT(xrt_mbx_msg, xrt_mbx_msg_dequeue,
+	TP_PROTO(struct device *dev, bool tx, u64 req_id, size_t len, u32 flags, u32 opcode),
+	TP_ARGS(dev, tx, req_id, len, flags, opcode)
+);
+
+/* Msg has missed its deadline. */
+DEFINE_EVENT(xrt_mbx_msg, xrt_mbx_msg_timeout,
+	TP_PROTO(struct device *dev, bool tx, u64 req_id, size_t len, u32 flags, u32 opcode),
+	TP_ARGS(dev, tx, req_id, len, flags, opcode)
+);
+
+/* Msg is done, latency counts from enqueue. */
+TRACE_EVENT(xrt_mbx_msg_done,
+	TP_PROTO(struct device *dev, bool tx, u64 req_id, size_t len, u32 opcode,
+		 u64 pkts, u64 lat_ns, int err),
+	TP_ARGS(dev, tx, req_id, len, opcode, pkts, lat_ns, err),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(bool, tx)
+		__field(u64, req_id)
+		__field(size_t, len)
+		__field(u32, opcode)
+		__field(u64, pkts)
+		__field(u64, lat_ns)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->tx = tx;
+		__entry->req_id = req_id;
+		__entry->len = len;
+		__entry->opcode = opcode;
+		__entry->pkts = pkts;
+		__entry->lat_ns = lat_ns;
+		__entry->err = err;
+	),
+	TP_printk("%s %s id=0x%llx len=%zu op=%u pkts=%llu lat=%lluns err=%d",
+		  __get_str(dev), __entry->tx ? "tx" : "rx", __entry->req_id,
+		  __entry->len, __entry->opcode, __entry->pkts, __entry->lat_ns,
+		  __entry->err)
+);
+
+DECLARE_EVENT_CLASS(xrt_mbx_pkt,
+	TP_PROTO(struct device *dev, u32 type, u32 size),
+	TP_ARGS(dev, type, size),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u32, type)
+		__field(u32, size)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->type = type;
+		__entry->size = size;
+	),
+	TP_printk("%s type=0x%x size=%u", __get_str(dev), __entry->type, __entry->size)
+);
+
+/* Pkt is pushed into HW TX FIFO. */
+DEFINE_EVENT(xrt_mbx_pkt, xrt_mbx_pkt_send,
+	TP_PROTO(struct device *dev, u32 type, u32 size),
+	TP_ARGS(dev, type, size)
+);
+
+/* Pkt is pulled out of HW RX FIFO. */
+DEFINE_EVENT(xrt_mbx_pkt, xrt_mbx_pkt_recv,
+	TP_PROTO(struct device *dev, u32 type, u32 size),
+	TP_ARGS(dev, type, size)
+);
+
+#endif /* _XRT_MAILBOX_TRACE_H_ */
+
+/* This part must be outside protection. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH xleaf
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mailbox-trace
+#include <trace/define_trace.h>
@@ -29,10 +29,38 @@
  * will not attempt to read the data from HW until a full packet has been
  * written to HW by peer.
  *
- * Interrupt is not enabled and driver will poll the HW periodically to see if
- * FIFO is ready for reading or writing. When there is outstanding msg to be
- * sent or received, driver will poll at high frequency. Otherwise, driver polls
- * HW at very low frequency so that it will not consume much CPU cycles.
+ * If metadata wires the mailbox to an MSI-X vector, the driver runs in interrupt
+ * mode. TX threshold interrupt (STI) fires when peer has drained our packet and
+ * RX threshold interrupt (RTI) fires when a full packet is ready for reading.
+ * Either one simply wakes up the corresponding channel thread.
+ *
+ * Otherwise, interrupt is not enabled and driver will poll the HW to see if FIFO
+ * is ready for reading or writing. Polling is adaptive. Right after any activity
+ * on the mailbox, channel threads keep polling for a short while, since peer is
+ * likely to respond very soon. Then, they back off exponentially, up to a few
+ * ms if there is msg to be sent or received, or all the way down to the very
+ * low idle frequency so that no CPU cycles are wasted. Polling parameters can
+ * be tuned via sysfs (mailbox_poll).
+ *
+ * If metadata only has XRT_MD_NODE_MAILBOX_LOOPBACK for the mailbox, there is
+ * no HW at all. Registers and FIFO are modelled in memory (struct mailbox_sim)
+ * and whatever is pushed into TX FIFO shows up in RX FIFO of the same instance,
+ * so the driver talks to itself. Threshold interrupts are raised by calling
+ * the ISR directly. This is for testing and benchmarking the driver on machines
+ * without a card, see selftests.
+ *
+ * Msg time out is driven by a per channel hrtimer, which is always armed for the
+ * earliest deadline of all msgs on the channel, so no periodic work is needed
+ * for timing out msgs. The low frequency timer only runs in polling mode and is
+ * shared by all mailboxes in polling mode, so there is one wake-up per tick no
+ * matter how many cards are installed.
+ *
+ * By default, the driver runs in burst mode. Once woken up, the channel thread
+ * keeps moving packets for as long as HW allows (STA for TX and RTA for RX),
+ * and it briefly spins on the status register when the peer is in the middle
+ * of a msg, so that a large msg is pumped at FIFO speed instead of one packet
+ * per wake-up. Each packet is moved with a single rep MMIO transfer and status
+ * is checked only once per packet. Burst mode can be turned off via sysfs.
  *
  * A packet is defined as struct mailbox_pkt. There are mainly two types of
  * packets: start-of-msg and msg-body packets. Both can carry end-of-msg flag to
@@ -62,21 +90,63 @@
  * layer, the driver will not attempt to send the next message until the
  * transmitting of current one is done. I.E., we implement a FIFO for message
  * TX channel. All messages are sent by driver in the order of received from
- * upper layer. We can implement msgs of different priority later, if needed.
+ * upper layer within the same priority class.
+ *
+ * If both ends agree on it at user probe time (XCL_MB_PEER_PKT_STREAM), each
+ * packet is tagged with a stream ID (PKT_TYPE_STREAM) and the assumption above
+ * holds per stream only. Receiving end keeps one partially received message
+ * for each stream. RX always accepts tagged packets, untagged ones belong to
+ * stream 0, so the format only has to be negotiated for TX.
+ *
+ * There are two priority classes for TX messages. Small messages (see
+ * MSG_PRIO_HIGH_MAX_SZ), such as notifications and most of the responses, are
+ * sent ahead of big ones so that they do not have to wait behind multiple bulk
+ * transfers. To avoid starving bulk transfers, one normal priority message is
+ * sent after every MSG_PRIO_HIGH_MAX_STREAK high priority ones, if there is any
+ * waiting. Without packet streams, a message being transmitted is never
+ * preempted. With them, a normal priority message being transmitted is parked
+ * whenever a high priority one is waiting, and the latter is sent on another
+ * stream. The parked one resumes after that.
+ *
+ * If peer has agreed on it at user probe time (XCL_MB_PEER_MSG_COMPRESS), payload
+ * of a HW message which is bigger than a threshold (see mailbox_compress_min in
+ * sysfs) is compressed with LZ4 before it is sent. Such message carries
+ * MSG_FLAG_LZ4 and its payload starts with the original size as u32, followed
+ * by the compressed data. Message is sent as is if it does not shrink. RX
+ * always accepts compressed messages. Software channel is never compressed.
+ * It is not offered to peer at all if kernel is built without LZ4 (see
+ * XRT_MAILBOX_LZ4). All senders share one LZ4 work area per mailbox.
+ *
+ * If peer has agreed on it at user probe time (XCL_MB_PEER_MSG_STRIPE) and the
+ * software channel is opened by daemon, a HW message which is bigger than a
+ * threshold (see mailbox_stripe in sysfs, off by default) is striped. It is cut
+ * into one segment for software channel and one for HW channel, so that daemon
+ * moves its share while HW FIFO is being pumped. Each segment is a message of
+ * its own with the same ID and MSG_FLAG_STRIPE, whose payload starts with struct
+ * mailbox_stripe_hdr. Receiving end puts the segments back together before the
+ * message is handed over. Segments may not overlap, and a message is not
+ * bigger than the response waiting for it or the limit of a request. Striped
+ * messages are dropped if peer has not agreed on striping. Effective
+ * bandwidth of striped messages is reported in mailbox_stats.
  *
  * On the RX side, there is no certain order for receiving messages. It's up to
  * the peer to decide which message gets enqueued into its own TX queue first,
  * which will be received first on the other side.
  *
- * A TX message is considered as time'd out when it's transmit is not done
- * within 1 seconds. An RX msg is considered as time'd out 20 seconds after the
- * corresponding TX one has been sent out. There is no retry after msg time'd
- * out. The error will be simply propagated back to the upper layer.
+ * A TX or RX message being transmitted is considered as time'd out when no
+ * progress is made within 1 second. An RX msg is considered as time'd out when
+ * its response is not received by the deadline, which is set by the caller
+ * once the corresponding TX one has been sent out. There is no retry after msg
+ * time'd out. The error will be simply propagated back to the upper layer.
  *
  * A msg is defined as struct mailbox_msg. It carrys a flag indicating that if
  * it's a msg of request or response msg. A response msg must have a big enough
  * msg buffer sitting in the receiver's RX queue waiting for it. A request msg
- * does not have a waiting msg buffer.
+ * does not have a waiting msg buffer. Received requests are queued up for the
+ * listener. Once the queue is full, new requests are answered right away by a
+ * response with MSG_FLAG_BUSY, if peer has agreed on it at user probe time
+ * (XCL_MB_PEER_BUSY_NACK), so that the requester can retry without waiting
+ * for time out. Otherwise, they are dropped.
  *
  *
  * Communication layer
@@ -99,9 +169,20 @@
  * request msg by msg ID, or it'll be silently dropped. A communication session
  * starts with a request and finishes with 0 or 1 response, always.
  *
- * Currently, the driver implements one kernel thread for RX channel (RX thread)
- * , one for TX channel (TX thread) and one thread for processing incoming
- * request (REQ thread).
+ * Monitoring clients tend to ask peer for the same data (XCL_MAILBOX_REQ_PEER_DATA)
+ * at the same time. While a PEER_DATA request is in flight, callers sending an
+ * identical one (same body and response size) are attached to it instead and
+ * share its response. Optionally, a good response can be reused for a short
+ * while after it's received. Both are configurable via sysfs (mailbox_coalesce).
+ *
+ * Currently, the driver implements one thread for RX channel (RX thread), one
+ * for TX channel (TX thread) and one for processing incoming request (REQ
+ * thread). They are not kernel threads, but works on one unbound workqueue
+ * shared by all mailboxes, which runs them on per NUMA node worker pools, close
+ * to the card. A work never runs on two CPUs at the same time, so each thread
+ * is still serialized. A channel thread moves a bounded number of pkts in one
+ * pass and, if there is more to do, queues itself again behind other cards'
+ * works, so cards get their fair share of the pool.
  *
  * The RX thread is responsible for receiving incoming msgs. If it's a request
  * or notification msg, it'll punt it to REQ thread for processing, which, in
@@ -130,8 +211,26 @@
  *
  * If the daemon wants to pass a msg (request or response) to a mailbox driver,
  * it can do so by calling write() driver interface. It may block and wait until
- * the previous msg is consumed by the RX thread before it can finish
- * transmiting its own msg and return back to user land.
+ * there is room in the RX queue before it can finish transmiting its own msg
+ * and return back to user land.
+ *
+ * Up to MAX_SW_MSG_QUEUE_LEN msgs can be pending on software channel in each
+ * direction, and one read() or write() can carry multiple msgs back to back, so
+ * that the daemon can forward msgs in batches.
+ *
+ * Alternatively, the daemon can mmap() a shared memory area from the device
+ * node, which contains one ring of fixed size slots for each direction (see
+ * struct xcl_sw_chan_shm). Msgs which fit in one slot are then passed through
+ * the rings directly without any extra copy or syscall for each msg. Bigger
+ * msgs still go through read() and write(). poll() is used for signaling in
+ * both directions.
+ *
+ *
+ * Tracing
+ *
+ * Msg life cycle (enqueue, dequeue, done and time out) and every pkt moved
+ * through HW are reported via tracepoints under xrt_mailbox event system, see
+ * mailbox-trace.h. They cost nothing when tracing is off.
  *
  *
  * Communication protocols
@@ -165,20 +264,32 @@
 #include <linux/mutex.h>
 #include <linux/completion.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
 #include <linux/poll.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/ioctl.h>
 #include <linux/delay.h>
-#include <linux/crc32c.h>
+#include <linux/hrtimer.h>
+#include <linux/rbtree.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/lz4.h>
 #include <linux/xrt/mailbox_transport.h>
+#include <linux/xrt/mailbox_proto.h>
 #include "metadata.h"
 #include "xleaf.h"
 #include "xleaf/mailbox.h"
 #include "xmgmt-main.h"
 
+#define CREATE_TRACE_POINTS
+#include "mailbox-trace.h"
+
 #define FLAG_STI		BIT(0)
 #define FLAG_RTI		BIT(1)
 
@@ -193,16 +304,46 @@
 #define MBX_INFO(mbx, fmt, arg...) xrt_info((mbx)->mbx_pdev, fmt "\n", ##arg)
 #define MBX_DBG(mbx, fmt, arg...) xrt_dbg((mbx)->mbx_pdev, fmt "\n", ##arg)
 
-#define MAILBOX_TTL_TIMER	(HZ / 10) /* in jiffies */
-#define MAILBOX_SEC2TTL(s)	((s) * HZ / MAILBOX_TTL_TIMER)
-#define MSG_MAX_TTL		INT_MAX /* used to disable TTL checking */
+#define MAILBOX_POLL_TIMER	(HZ / 10) /* in jiffies */
+#define MSG_INACTIVE_TIMEOUT_MS	1000 /* outstanding msg must make progress */
 
 #define INVALID_MSG_ID		((u64)-1)
 
-#define MAX_MSG_QUEUE_LEN	5
+/*
+ * In burst mode, max number of pkts moved in one worker pass and max time to
+ * wait for peer to catch up before going back to sleep.
+ */
+#define MAILBOX_BURST_PKTS	64
+#define MAILBOX_BURST_SPIN_US	20
+
+/*
+ * Default adaptive polling parameters. Keep polling for MAILBOX_POLL_SPIN_US
+ * after last activity, then sleep for MAILBOX_POLL_MIN_US, doubling each time,
+ * up to MAILBOX_POLL_MAX_US if channel has msg to work on, or up to
+ * MAILBOX_POLL_TIMER if it's idle.
+ */
+#define MAILBOX_POLL_SPIN_US	100
+#define MAILBOX_POLL_MIN_US	10
+#define MAILBOX_POLL_MAX_US	1000
+
+/*
+ * Default and max number of pending requests from peer. When the queue is full,
+ * new ones are answered right away with MSG_FLAG_BUSY, if peer understands it,
+ * otherwise, they are dropped.
+ */
+#define MAX_MSG_QUEUE_LEN	32
+#define MAX_MSG_QUEUE_LEN_LIMIT	1024
+#define MAX_SW_MSG_QUEUE_LEN	16
 #define MAX_REQ_MSG_SZ		(1024 * 1024)
 
+/*
+ * Max rounds of intr status handled in one ISR invocation. Channel threads
+ * keep moving packets once woken up, so anything left is picked up by them.
+ */
+#define MBX_ISR_MAX_ROUNDS	4
+
 #define MBX_SW_ONLY(mbx) (!(mbx)->mbx_regs)
+#define MBX_IRQ_MODE(mbx) ((mbx)->mbx_irq >= 0 || (mbx)->mbx_sim)
 /*
  * Mailbox IP register layout
  */
@@ -221,31 +362,108 @@ struct mailbox_reg {
 	u32			mbr_ctrl;
 } __packed;
 
+/*
+ * In memory model of mailbox IP for loopback mode. There is only one FIFO since
+ * our TX FIFO is also our RX FIFO. Errors are reported with the same bits as in
+ * status register and are cleared on read.
+ */
+#define MBX_SIM_FIFO_DEPTH	(PACKET_SIZE * 4) /* in DWORD, power of 2 */
+struct mailbox_sim {
+	spinlock_t		ms_lock; /* protects everything below */
+	struct mailbox_reg	ms_regs;
+	u32			ms_fifo[MBX_SIM_FIFO_DEPTH];
+	u32			ms_head; /* free running, DWORDs pushed */
+	u32			ms_tail; /* free running, DWORDs popped */
+};
+
 /*
  * A message transport by mailbox.
  */
 #define MSG_FLAG_RESPONSE	BIT(0)
 #define MSG_FLAG_REQUEST	BIT(1)
+#define MSG_FLAG_BUSY		BIT(2) /* response: peer is too busy to take req */
+#define MSG_FLAG_LZ4		BIT(3) /* payload is compressed */
+#define MSG_FLAG_STRIPE		BIT(4) /* payload is one segment of a msg */
+
+/* Default min size of msg payload to be compressed, 0 turns it off. */
+#define MSG_COMPRESS_MIN_SZ	4096
+/* Compressed payload starts with size of the original one. */
+#define MSG_LZ4_HDR_SZ		sizeof(u32)
+
+/* Segment of a striped msg starts with where it belongs in the original one. */
+struct mailbox_stripe_hdr {
+	u32			msh_offset;
+	u32			msh_total;
+} __packed;
+#define MSG_STRIPE_HDR_SZ	sizeof(struct mailbox_stripe_hdr)
+
+/*
+ * Default share of a striped msg going through software channel, in percent,
+ * and limits of striped msgs being put together on RX side.
+ */
+#define MSG_STRIPE_SW_PCT	50
+#define MBX_STRIPE_MAX_SZ	(64 * 1024 * 1024)
+#define MBX_STRIPE_MAX_PENDING	8
+/* TX cuts a msg into two segments, RX takes a few more. */
+#define MBX_STRIPE_MAX_SEGS	4
+
+/* TX msg priority classes, RX msgs are always MSG_PRIO_NORMAL. */
+enum mailbox_msg_prio {
+	MSG_PRIO_HIGH = 0,
+	MSG_PRIO_NORMAL,
+	MSG_PRIO_NUM
+};
+
+#define MSG_PRIO_HIGH_MAX_SZ		4096
+#define MSG_PRIO_HIGH_MAX_STREAK	8
+
+#define MBX_MSG_HASH_BITS		6
+/* A big msg being sent can be preempted by one small msg at a time. */
+#define MBX_TX_STREAMS			2
+
 struct mailbox_msg {
 	struct list_head	mbm_list;
+	struct hlist_node	mbm_hnode; /* RX msgs are also indexed by ID */
+	struct rb_node		mbm_tnode; /* and by deadline, if it's set */
 	struct mailbox_channel	*mbm_ch;
 	u64			mbm_req_id;
 	char			*mbm_data;
 	size_t			mbm_len;
+	/* Compressed payload as sent / received on HW channel, if any. */
+	char			*mbm_zbuf;
+	size_t			mbm_zlen;
 	int			mbm_error;
 	struct completion	mbm_complete;
 	mailbox_msg_cb_t	mbm_cb;
 	void			*mbm_cb_arg;
 	u32			mbm_flags;
-	atomic_t		mbm_ttl;
+	ktime_t			mbm_deadline; /* KTIME_MAX if not set */
+	u32			mbm_timeout_ms; /* async resp, armed once req is sent */
 	bool			mbm_chan_sw;
+	enum mailbox_msg_prio	mbm_prio;
+	int			mbm_cache; /* index of msg cache, or -1 */
+	/* TX segment of a striped msg points back to the msg it's cut from. */
+	struct mailbox_msg	*mbm_stripe_parent;
+	atomic_t		mbm_stripe_left; /* segments of striped msg in flight */
+	bool			mbm_striped; /* sent or received in segments */
 
 	/* Statistics for debugging. */
 	u64			mbm_num_pkts;
+	u32			mbm_opcode; /* for stats only, see msg_opcode() */
+	u64			mbm_enq_ts;
 	u64			mbm_start_ts;
 	u64			mbm_end_ts;
 };
 
+/*
+ * A msg queued on software channel, waiting to be picked up by daemon (TX)
+ * or by RX thread (RX).
+ */
+struct sw_chan_msg {
+	struct list_head	scm_list;
+	struct xcl_sw_chan	scm_hdr; /* must be the last, followed by payload */
+};
+
 /* Mailbox communication channel state. */
 #define MBXCS_BIT_READY		0
 #define MBXCS_BIT_STOP		1
@@ -258,34 +476,114 @@ enum mailbox_chan_type {
 
 struct mailbox_channel;
 typedef	bool (*chan_func_t)(struct mailbox_channel *ch);
+/*
+ * Latency of successfully done msgs is accounted per opcode in log2 buckets of
+ * microseconds. Bucket 0 is for < 1us, bucket N (N > 0) is for [2^(N-1), 2^N)
+ * and the last one also takes all longer ones. Two stages are measured, from
+ * enqueue to first pkt (wait) and from enqueue to done (total). For a response
+ * msg, the wait stage covers sending the request and peer processing it.
+ */
+#define MBX_LAT_BUCKETS		24
+#define MBX_LAT_OPCODES		(XCL_MAILBOX_REQ_READ_P2P_BAR_ADDR + 1)
+
+enum mailbox_lat_stage {
+	MBX_LAT_WAIT = 0,
+	MBX_LAT_TOTAL,
+	MBX_LAT_NUM
+};
+
+static const char * const mailbox_lat_stage_name[] = { "wait", "total" };
+
+struct mailbox_chan_stats {
+	u64			mcs_msgs;
+	u64			mcs_bytes;
+	u64			mcs_pkts;
+	u64			mcs_errors;
+	u64			mcs_timeouts;
+	u64			mcs_drops;
+	u64			mcs_peer_dead;
+	/* Striped msgs, time counts from first pkt to done. */
+	u64			mcs_stripe_msgs;
+	u64			mcs_stripe_bytes;
+	u64			mcs_stripe_ns;
+	u64			mcs_lat[MBX_LAT_OPCODES][MBX_LAT_NUM][MBX_LAT_BUCKETS];
+};
+
+/* Striped msg being put together by RX thread. */
+struct mailbox_stripe {
+	struct list_head	mst_list;
+	u64			mst_id;
+	u32			mst_flags; /* of the original msg */
+	u32			mst_total;
+	u32			mst_received;
+	/* Segments received so far, never overlapping. */
+	u32			mst_nsegs;
+	struct {
+		u32		off;
+		u32		len;
+	}			mst_segs[MBX_STRIPE_MAX_SEGS];
+	u64			mst_num_pkts;
+	u64			mst_start_ts;
+	char			*mst_buf;
+};
+
+/* Partially transferred msg parked on a stream. */
+struct mailbox_stream {
+	struct mailbox_msg	*mbs_msg;
+	int			mbs_bytes_done;
+};
+
 struct mailbox_channel {
 	struct mailbox		*mbc_parent;
 	enum mailbox_chan_type	mbc_type;
 
-	struct workqueue_struct	*mbc_wq;
-	struct work_struct	mbc_work;
-	struct completion	mbc_worker;
+	struct work_struct	mbc_work; /* one pass, run by mailbox_wq */
+	int			mbc_node; /* NUMA node to run mbc_work on */
 	chan_func_t		mbc_tran;
 	unsigned long		mbc_state;
 
 	struct mutex		mbc_mutex; /* lock for hw channel */
-	struct list_head	mbc_msgs;
+	struct list_head	mbc_msgs[MSG_PRIO_NUM];
+	DECLARE_HASHTABLE(mbc_msg_hash, MBX_MSG_HASH_BITS);
+	struct rb_root_cached	mbc_deadlines;
+	struct hrtimer		mbc_timer;
+	ktime_t			mbc_timer_expires; /* KTIME_MAX if not armed */
+	struct hrtimer		mbc_poll_timer; /* next pass in polling mode */
+	/* Number of high prio msgs sent in a row while normal ones are waiting. */
+	u32			mbc_hi_streak;
+	u32			mbc_queued;
+	u32			mbc_poll_us; /* current back off in polling mode */
+
+	spinlock_t		mbc_stats_lock; /* msg_done() can be called anywhere */
+	struct mailbox_chan_stats mbc_stats;
 
 	struct mailbox_msg	*mbc_cur_msg;
 	int			mbc_bytes_done;
 	struct mailbox_pkt	mbc_packet;
+	/*
+	 * Msgs on other streams are parked here while mbc_cur_msg is being
+	 * transferred on stream mbc_stream. Only touched by channel thread.
+	 */
+	struct mailbox_stream	mbc_streams[PKT_STREAM_NUM];
+	u32			mbc_stream;
 
 	/*
 	 * Software channel settings
 	 */
 	wait_queue_head_t	sw_chan_wq;
 	struct mutex		sw_chan_mutex; /* lock for sw channel */
-	void			*sw_chan_buf;
-	size_t			sw_chan_buf_sz;
-	u64			sw_chan_msg_id;
-	u64			sw_chan_msg_flags;
+	struct list_head	sw_chan_msgs;
 
 	atomic_t		sw_num_pending_msg;
+
+	/*
+	 * Software channel ring in shared memory, if mmap'ed by daemon. Index is
+	 * our own copy of producer (TX) or consumer (RX) counter, never read back
+	 * from shared memory.
+	 */
+	struct xcl_sw_chan_ring	*sw_chan_ring;
+	void			*sw_chan_slots;
+	u32			sw_chan_ring_idx;
 };
 
 /*
@@ -293,8 +591,18 @@ struct mailbox_channel {
  */
 struct mailbox {
 	struct platform_device	*mbx_pdev;
-	struct timer_list	mbx_poll_timer;
+	int			mbx_node; /* NUMA node of the card */
+	struct list_head	mbx_poll_node; /* on mailbox_poll_list */
 	struct mailbox_reg	*mbx_regs;
+	struct mailbox_sim	*mbx_sim; /* loopback mode, mbx_regs points to it */
+	int			mbx_irq; /* negative in polling mode */
+	bool			mbx_burst; /* move multiple pkts per worker pass */
+	/* Adaptive polling parameters and last time any channel made progress. */
+	u32			mbx_poll_spin_us;
+	u32			mbx_poll_min_us;
+	u32			mbx_poll_max_us;
+	ktime_t			mbx_active_ts;
+	bool			mbx_pkt_stream; /* peer takes interleaved msgs */
 
 	struct mailbox_channel	mbx_rx;
 	struct mailbox_channel	mbx_tx;
@@ -303,7 +611,6 @@ struct mailbox {
 	mailbox_msg_cb_t	mbx_listen_cb;
 	void			*mbx_listen_cb_arg;
 	struct mutex		mbx_listen_cb_lock; /* listen callback lock */
-	struct workqueue_struct	*mbx_listen_wq;
 	struct work_struct	mbx_listen_worker;
 
 	/*
@@ -313,14 +620,43 @@ struct mailbox {
 	struct mailbox_pkt	mbx_tst_pkt;
 
 	/* Req list for all incoming request message */
-	struct completion	mbx_comp;
 	struct mutex		mbx_lock; /* incoming request list lock */
 	struct list_head	mbx_req_list;
 	u32			mbx_req_cnt;
+	u32			mbx_req_max; /* configurable via sysfs */
 	bool			mbx_listen_stop;
+	bool			mbx_busy_nack; /* peer takes MSG_FLAG_BUSY */
+	bool			mbx_compress; /* peer takes MSG_FLAG_LZ4 */
+	u32			mbx_compress_min; /* configurable via sysfs */
+	struct mutex		mbx_lz4_lock; /* protects mbx_lz4_wrkmem */
+	void			*mbx_lz4_wrkmem; /* NULL if compression is not available */
+	bool			mbx_stripe; /* peer takes MSG_FLAG_STRIPE */
+	u32			mbx_stripe_min; /* configurable via sysfs */
+	u32			mbx_stripe_sw_pct; /* configurable via sysfs */
+	/* Striped msgs being put together, only touched by RX thread. */
+	struct list_head	mbx_stripes;
+	u32			mbx_stripe_cnt;
+
+	/* Identical PEER_DATA requests being shared. */
+	struct mutex		mbx_coalesce_lock; /* protects everything below */
+	struct list_head	mbx_coalesce;
+	bool			mbx_coalesce_on; /* configurable via sysfs */
+	u32			mbx_coalesce_ms; /* configurable via sysfs */
+	u64			mbx_coalesced; /* number of requests not sent */
+
+	/*
+	 * Last ID given to async request. Never reused, and never collides with
+	 * kernel address used as ID by others.
+	 */
+	atomic64_t		mbx_req_id;
 
 	bool			mbx_peer_dead;
 	u64			mbx_opened;
+
+	/* Software channel shared memory, protected by mbx_lock. */
+	struct xcl_sw_chan_shm	*mbx_sw_shm;
+	/* Daemon can take multiple msgs in one read(). */
+	bool			mbx_sw_batch;
 };
 
 static inline const char *reg2name(struct mailbox *mbx, u32 *reg)
@@ -344,9 +680,143 @@ static inline const char *reg2name(struct mailbox *mbx, u32 *reg)
 		(uintptr_t)mbx->mbx_regs) / sizeof(u32)];
 }
 
+static irqreturn_t mailbox_isr(int irq, void *arg);
+
+static u32 sim_status(struct mailbox_sim *sim)
+{
+	u32 level = sim->ms_head - sim->ms_tail;
+	u32 st = 0;
+
+	if (level == 0)
+		st |= STATUS_EMPTY;
+	if (level == MBX_SIM_FIFO_DEPTH)
+		st |= STATUS_FULL;
+	if (level <= sim->ms_regs.mbr_sit)
+		st |= STATUS_STA;
+	if (level > sim->ms_regs.mbr_rit)
+		st |= STATUS_RTA;
+	return st;
+}
+
+/*
+ * Latch intr for threshold crossed since old_st was taken. Caller should call
+ * ISR after dropping the lock if it returns true.
+ */
+static bool sim_intr(struct mailbox_sim *sim, u32 old_st)
+{
+	u32 rising = sim_status(sim) & ~old_st;
+	u32 is = 0;
+
+	if (rising & STATUS_STA)
+		is |= FLAG_STI;
+	if (rising & STATUS_RTA)
+		is |= FLAG_RTI;
+	sim->ms_regs.mbr_is |= is;
+	sim->ms_regs.mbr_ip = sim->ms_regs.mbr_is & sim->ms_regs.mbr_ie;
+	return (is & sim->ms_regs.mbr_ie) != 0;
+}
+
+static void sim_fifo_rd(struct mailbox *mbx, u32 *buf, u32 cnt)
+{
+	struct mailbox_sim *sim = mbx->mbx_sim;
+	bool intr;
+	u32 st, i;
+
+	spin_lock(&sim->ms_lock);
+	st = sim_status(sim);
+	for (i = 0; i < cnt; i++) {
+		if (sim->ms_head == sim->ms_tail) {
+			sim->ms_regs.mbr_error |= STATUS_EMPTY;
+			buf[i] = 0;
+			continue;
+		}
+		buf[i] = sim->ms_fifo[sim->ms_tail++ % MBX_SIM_FIFO_DEPTH];
+	}
+	intr = sim_intr(sim, st);
+	spin_unlock(&sim->ms_lock);
+
+	if (intr)
+		mailbox_isr(-1, mbx);
+}
+
+static void sim_fifo_wr(struct mailbox *mbx, const u32 *buf, u32 cnt)
+{
+	struct mailbox_sim *sim = mbx->mbx_sim;
+	bool intr;
+	u32 st, i;
+
+	spin_lock(&sim->ms_lock);
+	st = sim_status(sim);
+	for (i = 0; i < cnt; i++) {
+		if (sim->ms_head - sim->ms_tail == MBX_SIM_FIFO_DEPTH) {
+			sim->ms_regs.mbr_error |= STATUS_FULL;
+			continue;
+		}
+		sim->ms_fifo[sim->ms_head++ % MBX_SIM_FIFO_DEPTH] = buf[i];
+	}
+	intr = sim_intr(sim, st);
+	spin_unlock(&sim->ms_lock);
+
+	if (intr)
+		mailbox_isr(-1, mbx);
+}
+
+static u32 sim_reg_rd(struct mailbox *mbx, u32 *reg)
+{
+	struct mailbox_sim *sim = mbx->mbx_sim;
+	u32 val;
+
+	if (reg == &sim->ms_regs.mbr_rddata) {
+		sim_fifo_rd(mbx, &val, 1);
+		return val;
+	}
+
+	spin_lock(&sim->ms_lock);
+	if (reg == &sim->ms_regs.mbr_status) {
+		val = sim_status(sim);
+	} else if (reg == &sim->ms_regs.mbr_error) {
+		val = sim->ms_regs.mbr_error;
+		sim->ms_regs.mbr_error = 0;
+	} else {
+		val = *reg;
+	}
+	spin_unlock(&sim->ms_lock);
+	return val;
+}
+
+static void sim_reg_wr(struct mailbox *mbx, u32 *reg, u32 val)
+{
+	struct mailbox_sim *sim = mbx->mbx_sim;
+	bool intr;
+	u32 st;
+
+	if (reg == &sim->ms_regs.mbr_wrdata) {
+		sim_fifo_wr(mbx, &val, 1);
+		return;
+	}
+
+	spin_lock(&sim->ms_lock);
+	st = sim_status(sim);
+	if (reg == &sim->ms_regs.mbr_is) {
+		/* Write 1 to clear. */
+		sim->ms_regs.mbr_is &= ~val;
+	} else if (reg == &sim->ms_regs.mbr_ctrl) {
+		/* Resetting either TX or RX FIFO resets the only FIFO we have. */
+		if (val & 0x3)
+			sim->ms_tail = sim->ms_head;
+	} else {
+		*reg = val;
+	}
+	intr = sim_intr(sim, st);
+	spin_unlock(&sim->ms_lock);
+
+	if (intr)
+		mailbox_isr(-1, mbx);
+}
+
 static inline u32 mailbox_reg_rd(struct mailbox *mbx, u32 *reg)
 {
-	u32 val = ioread32(reg);
+	u32 val = mbx->mbx_sim ? sim_reg_rd(mbx, reg) : ioread32(reg);
 
 	MBX_DBG(mbx, "REG_RD(%s)=0x%x", reg2name(mbx, reg), val);
 	return val;
@@ -355,7 +825,10 @@ static inline u32 mailbox_reg_rd(struct mailbox *mbx, u32 *reg)
 static inline void mailbox_reg_wr(struct mailbox *mbx, u32 *reg, u32 val)
 {
 	MBX_DBG(mbx, "REG_WR(%s, 0x%x)", reg2name(mbx, reg), val);
-	iowrite32(val, reg);
+	if (mbx->mbx_sim)
+		sim_reg_wr(mbx, reg, val);
+	else
+		iowrite32(val, reg);
 }
 
 static inline void reset_pkt(struct mailbox_pkt *pkt)
@@ -383,274 +856,903 @@ static bool is_rx_msg(struct mailbox_msg *msg)
 	return is_rx_chan(msg->mbm_ch);
 }
 
-static void chan_tick(struct mailbox_channel *ch)
-{
-	mutex_lock(&ch->mbc_mutex);
-
-	set_bit(MBXCS_BIT_TICK, &ch->mbc_state);
-	complete(&ch->mbc_worker);
+/*
+ * Channel and REQ works of all mailboxes are run by one unbound workqueue, which
+ * has one worker pool per NUMA node. Mailboxes in polling mode are kicked by one
+ * low frequency timer shared by all of them.
+ */
+static struct workqueue_struct *mailbox_wq;
+static DEFINE_SPINLOCK(mailbox_poll_lock); /* protects mailbox_poll_list */
+static LIST_HEAD(mailbox_poll_list);
 
-	mutex_unlock(&ch->mbc_mutex);
+/*
+ * Kick channel thread, safe to be called in intr context. Work being run is
+ * queued again, so no kick is lost.
+ */
+static inline void chan_wakeup(struct mailbox_channel *ch)
+{
+	if (!test_bit(MBXCS_BIT_STOP, &ch->mbc_state))
+		queue_work_node(ch->mbc_node, mailbox_wq, &ch->mbc_work);
 }
 
-static void mailbox_poll_timer(struct timer_list *t)
+/* Time for next pass in polling mode. */
+static enum hrtimer_restart chan_poll_timer(struct hrtimer *timer)
 {
-	struct mailbox *mbx = from_timer(mbx, t, mbx_poll_timer);
-
-	chan_tick(&mbx->mbx_tx);
-	chan_tick(&mbx->mbx_rx);
+	struct mailbox_channel *ch = container_of(timer, struct mailbox_channel, mbc_poll_timer);
 
-	/* We're a periodic timer. */
-	mutex_lock(&mbx->mbx_lock);
-	mod_timer(&mbx->mbx_poll_timer, jiffies + MAILBOX_TTL_TIMER);
-	mutex_unlock(&mbx->mbx_lock);
+	chan_wakeup(ch);
+	return HRTIMER_NORESTART;
 }
 
-static void free_msg(struct mailbox_msg *msg)
+/* Some msg on the channel has reached its deadline. */
+static enum hrtimer_restart chan_timer(struct hrtimer *timer)
 {
-	vfree(msg);
+	struct mailbox_channel *ch = container_of(timer, struct mailbox_channel, mbc_timer);
+
+	set_bit(MBXCS_BIT_TICK, &ch->mbc_state);
+	chan_wakeup(ch);
+	return HRTIMER_NORESTART;
 }
 
-static void msg_done(struct mailbox_msg *msg, int err)
+/* Make sure channel timer fires no later than @expires, mbc_mutex must be held. */
+static void chan_timer_arm(struct mailbox_channel *ch, ktime_t expires)
 {
-	struct mailbox_channel *ch = msg->mbm_ch;
-	struct mailbox *mbx = ch->mbc_parent;
-	u64 elapsed = (msg->mbm_end_ts - msg->mbm_start_ts) / 1000; /* in us. */
+	WARN_ON(!mutex_is_locked(&ch->mbc_mutex));
 
-	MBX_INFO(ch->mbc_parent, "msg(id=0x%llx sz=%zuB crc=0x%x): %s %lldpkts in %lldus: %d",
-		 msg->mbm_req_id, msg->mbm_len,
-		 crc32c_le(~0, msg->mbm_data, msg->mbm_len),
-		 ch_name(ch), msg->mbm_num_pkts, elapsed, err);
+	if (!ktime_before(expires, ch->mbc_timer_expires))
+		return;
 
-	msg->mbm_error = err;
+	ch->mbc_timer_expires = expires;
+	hrtimer_start(&ch->mbc_timer, expires, HRTIMER_MODE_ABS);
+}
 
-	if (msg->mbm_cb) {
-		msg->mbm_cb(msg->mbm_cb_arg, msg->mbm_data, msg->mbm_len,
-			    msg->mbm_req_id, msg->mbm_error, msg->mbm_chan_sw);
-		free_msg(msg);
-		return;
-	}
+static void mailbox_poll_timer(struct timer_list *t);
+static DEFINE_TIMER(mailbox_poll_ticker, mailbox_poll_timer);
 
-	if (is_rx_msg(msg) && (msg->mbm_flags & MSG_FLAG_REQUEST)) {
-		if (err) {
-			MBX_WARN(mbx, "Time'd out receiving full req message");
-			free_msg(msg);
-		} else if (mbx->mbx_req_cnt >= MAX_MSG_QUEUE_LEN) {
-			MBX_WARN(mbx, "Too many pending req messages, dropped");
-			free_msg(msg);
-		} else {
-			mutex_lock(&ch->mbc_parent->mbx_lock);
-			list_add_tail(&msg->mbm_list, &ch->mbc_parent->mbx_req_list);
-			mbx->mbx_req_cnt++;
-			mutex_unlock(&ch->mbc_parent->mbx_lock);
-			complete(&ch->mbc_parent->mbx_comp);
-		}
-	} else {
-		complete(&msg->mbm_complete);
+static void mailbox_poll_timer(struct timer_list *t)
+{
+	struct mailbox *mbx;
+
+	spin_lock(&mailbox_poll_lock);
+	list_for_each_entry(mbx, &mailbox_poll_list, mbx_poll_node) {
+		chan_wakeup(&mbx->mbx_tx);
+		chan_wakeup(&mbx->mbx_rx);
 	}
+	/* We're a periodic timer for as long as anyone is polling. */
+	if (!list_empty(&mailbox_poll_list))
+		mod_timer(&mailbox_poll_ticker, jiffies + MAILBOX_POLL_TIMER);
+	spin_unlock(&mailbox_poll_lock);
 }
 
-static void reset_sw_ch(struct mailbox_channel *ch)
+static void mailbox_poll_register(struct mailbox *mbx)
 {
-	WARN_ON(!mutex_is_locked(&ch->sw_chan_mutex));
-
-	vfree(ch->sw_chan_buf);
-	ch->sw_chan_buf = NULL;
-	ch->sw_chan_buf_sz = 0;
-	ch->sw_chan_msg_flags = 0;
-	ch->sw_chan_msg_id = 0;
-	atomic_dec_if_positive(&ch->sw_num_pending_msg);
+	spin_lock_bh(&mailbox_poll_lock);
+	list_add_tail(&mbx->mbx_poll_node, &mailbox_poll_list);
+	if (!timer_pending(&mailbox_poll_ticker))
+		mod_timer(&mailbox_poll_ticker, jiffies + MAILBOX_POLL_TIMER);
+	spin_unlock_bh(&mailbox_poll_lock);
 }
 
-static void reset_hw_ch(struct mailbox_channel *ch)
+/* Mailbox won't be kicked by shared poll timer once this returns. */
+static void mailbox_poll_unregister(struct mailbox *mbx)
 {
-	struct mailbox *mbx = ch->mbc_parent;
+	spin_lock_bh(&mailbox_poll_lock);
+	list_del_init(&mbx->mbx_poll_node);
+	spin_unlock_bh(&mailbox_poll_lock);
+}
 
-	if (!mbx->mbx_regs)
-		return;
+/*
+ * Msg caches, one for msg header only and the rest for msg with small payload
+ * in different size classes. Bigger msg falls back to kvmalloc. So does every
+ * msg if cache can't be created.
+ */
+static const size_t mailbox_msg_cache_sz[] = { 0, 256, 1024, 4096 };
+static const char * const mailbox_msg_cache_name[] = {
+	"xrt_mailbox_msg",
+	"xrt_mailbox_msg_256",
+	"xrt_mailbox_msg_1k",
+	"xrt_mailbox_msg_4k",
+};
 
-	mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_ctrl, is_rx_chan(ch) ? 0x2 : 0x1);
-}
+static struct kmem_cache *mailbox_msg_cache[ARRAY_SIZE(mailbox_msg_cache_sz)];
 
-static void chan_msg_done(struct mailbox_channel *ch, int err)
+static void mailbox_msg_cache_fini(void)
 {
-	if (!ch->mbc_cur_msg)
-		return;
+	int i;
 
-	ch->mbc_cur_msg->mbm_end_ts = ktime_get_ns();
-	if (err) {
-		if (ch->mbc_cur_msg->mbm_chan_sw) {
-			mutex_lock(&ch->sw_chan_mutex);
-			reset_sw_ch(ch);
-			mutex_unlock(&ch->sw_chan_mutex);
-		} else {
-			reset_hw_ch(ch);
-		}
+	for (i = 0; i < ARRAY_SIZE(mailbox_msg_cache); i++) {
+		kmem_cache_destroy(mailbox_msg_cache[i]);
+		mailbox_msg_cache[i] = NULL;
 	}
-
-	msg_done(ch->mbc_cur_msg, err);
-	ch->mbc_cur_msg = NULL;
-	ch->mbc_bytes_done = 0;
 }
 
-static void timeout_msg(struct mailbox_channel *ch)
+static void mailbox_msg_cache_init(void)
 {
-	struct mailbox *mbx = ch->mbc_parent;
-	struct mailbox_msg *msg = NULL;
-	struct list_head *pos, *n;
-	struct list_head l = LIST_HEAD_INIT(l);
+	int i;
 
-	/* Check outstanding msg first. */
-	msg = ch->mbc_cur_msg;
-	if (msg) {
-		if (atomic_dec_if_positive(&msg->mbm_ttl) < 0) {
-			MBX_WARN(mbx, "found outstanding msg time'd out");
-			if (!mbx->mbx_peer_dead) {
-				MBX_WARN(mbx, "peer becomes dead");
-				/* Peer is not active any more. */
-				mbx->mbx_peer_dead = true;
-			}
-			chan_msg_done(ch, -ETIMEDOUT);
-		}
+	for (i = 0; i < ARRAY_SIZE(mailbox_msg_cache); i++) {
+		mailbox_msg_cache[i] = kmem_cache_create(mailbox_msg_cache_name[i],
+							 sizeof(struct mailbox_msg) +
+							 mailbox_msg_cache_sz[i], 0, 0, NULL);
 	}
+}
 
-	mutex_lock(&ch->mbc_mutex);
+static struct mailbox_msg *mailbox_msg_zalloc(size_t len)
+{
+	struct mailbox_msg *msg;
+	int i;
 
-	list_for_each_safe(pos, n, &ch->mbc_msgs) {
-		msg = list_entry(pos, struct mailbox_msg, mbm_list);
-		if (atomic_dec_if_positive(&msg->mbm_ttl) < 0) {
-			list_del(&msg->mbm_list);
-			list_add_tail(&msg->mbm_list, &l);
-		}
+	for (i = 0; i < ARRAY_SIZE(mailbox_msg_cache); i++) {
+		if (len > mailbox_msg_cache_sz[i] || !mailbox_msg_cache[i])
+			continue;
+		msg = kmem_cache_zalloc(mailbox_msg_cache[i], GFP_KERNEL);
+		if (msg)
+			msg->mbm_cache = i;
+		return msg;
 	}
 
-	mutex_unlock(&ch->mbc_mutex);
+	msg = kvzalloc(sizeof(*msg) + len, GFP_KERNEL);
+	if (msg)
+		msg->mbm_cache = -1;
+	return msg;
+}
 
-	if (!list_empty(&l))
-		MBX_ERR(mbx, "found awaiting msg time'd out");
+static void free_msg(struct mailbox_msg *msg)
+{
+	kvfree(msg->mbm_zbuf);
+	if (msg->mbm_cache < 0)
+		kvfree(msg);
+	else
+		kmem_cache_free(mailbox_msg_cache[msg->mbm_cache], msg);
+}
 
-	list_for_each_safe(pos, n, &l) {
-		msg = list_entry(pos, struct mailbox_msg, mbm_list);
-		list_del(&msg->mbm_list);
-		msg_done(msg, -ETIMEDOUT);
-	}
+/* Payload as it goes over the wire. */
+static inline char *msg_wire_data(struct mailbox_msg *msg)
+{
+	return msg->mbm_zbuf ? msg->mbm_zbuf : msg->mbm_data;
 }
 
-static void msg_timer_on(struct mailbox_msg *msg, u32 ttl)
+static inline size_t msg_wire_len(struct mailbox_msg *msg)
 {
-	atomic_set(&msg->mbm_ttl, MAILBOX_SEC2TTL(ttl));
+	return msg->mbm_zbuf ? msg->mbm_zlen : msg->mbm_len;
 }
 
 /*
- * Reset TTL for outstanding msg. Next portion of the msg is expected to
- * arrive or go out before it times out.
+ * Compress payload of TX msg into mbm_zbuf, if it's worth it. Failing to do so
+ * is not an error, msg is simply sent as is.
  */
-static void outstanding_msg_ttl_reset(struct mailbox_channel *ch)
+static void msg_compress(struct mailbox *mbx, struct mailbox_msg *msg)
 {
-	struct mailbox_msg *msg = ch->mbc_cur_msg;
+	size_t cap = msg->mbm_len - MSG_LZ4_HDR_SZ - 1;
+	char *zbuf = NULL;
+	int n = 0;
 
-	if (!msg)
+	if (!XRT_MAILBOX_LZ4 || !mbx->mbx_lz4_wrkmem)
+		return;
+	if (msg->mbm_chan_sw || !mbx->mbx_compress || !mbx->mbx_compress_min ||
+	    msg->mbm_len < max_t(size_t, mbx->mbx_compress_min, MSG_LZ4_HDR_SZ + 1) ||
+	    msg->mbm_len > LZ4_MAX_INPUT_SIZE)
+		return;
+
+	/* No room for output bigger than the original, won't help anyway. */
+	zbuf = kvmalloc(MSG_LZ4_HDR_SZ + cap, GFP_KERNEL);
+	if (zbuf) {
+		mutex_lock(&mbx->mbx_lz4_lock);
+		n = LZ4_compress_default(msg->mbm_data, zbuf + MSG_LZ4_HDR_SZ,
+					 msg->mbm_len, cap, mbx->mbx_lz4_wrkmem);
+		mutex_unlock(&mbx->mbx_lz4_lock);
+	}
+	if (n <= 0) {
+		kvfree(zbuf);
 		return;
+	}
 
-	// outstanding msg will time out if no progress is made within 1 second.
-	msg_timer_on(msg, 1);
+	*(u32 *)zbuf = msg->mbm_len;
+	msg->mbm_zbuf = zbuf;
+	msg->mbm_zlen = MSG_LZ4_HDR_SZ + n;
+	msg->mbm_flags |= MSG_FLAG_LZ4;
 }
 
-static void handle_timer_event(struct mailbox_channel *ch)
+/* Check if TX msg should be striped across HW and SW channels. */
+static bool msg_stripe_wanted(struct mailbox *mbx, struct mailbox_msg *msg)
 {
-	if (!test_bit(MBXCS_BIT_TICK, &ch->mbc_state))
-		return;
-	timeout_msg(ch);
-	clear_bit(MBXCS_BIT_TICK, &ch->mbc_state);
+	return !MBX_SW_ONLY(mbx) && mbx->mbx_stripe && mbx->mbx_stripe_min &&
+	       READ_ONCE(mbx->mbx_opened) && !msg->mbm_chan_sw &&
+	       !(msg->mbm_flags & MSG_FLAG_STRIPE) &&
+	       msg->mbm_len >= max_t(size_t, mbx->mbx_stripe_min, 2) &&
+	       msg->mbm_len <= MBX_STRIPE_MAX_SZ;
 }
 
-static void chan_worker(struct work_struct *work)
+/* Prepare RX msg for receiving @zlen bytes of compressed payload. */
+static int msg_zbuf_alloc(struct mailbox_msg *msg, size_t zlen)
 {
-	struct mailbox_channel *ch = container_of(work, struct mailbox_channel, mbc_work);
-	struct mailbox *mbx = ch->mbc_parent;
-	bool progress;
-
-	while (!test_bit(MBXCS_BIT_STOP, &ch->mbc_state)) {
-		if (ch->mbc_cur_msg) {
-			// fast poll (1000/s) to finish outstanding msg
-			usleep_range(1000, 2000);
-		} else {
-			// Wait for next poll timer trigger
-			wait_for_completion_interruptible(&ch->mbc_worker);
-		}
+	if (zlen <= MSG_LZ4_HDR_SZ || zlen > MSG_LZ4_HDR_SZ + LZ4_COMPRESSBOUND(msg->mbm_len))
+		return -EBADMSG;
 
-		progress = ch->mbc_tran(ch);
-		if (progress) {
-			outstanding_msg_ttl_reset(ch);
-			if (mbx->mbx_peer_dead) {
-				MBX_INFO(mbx, "peer becomes active");
-				mbx->mbx_peer_dead = false;
-			}
-		}
+	msg->mbm_zbuf = kvmalloc(zlen, GFP_KERNEL);
+	if (!msg->mbm_zbuf)
+		return -ENOMEM;
+	msg->mbm_zlen = zlen;
+	return 0;
+}
 
-		handle_timer_event(ch);
+/* Decompress fully received RX msg into mbm_data. */
+static int msg_decompress(struct mailbox *mbx, struct mailbox_msg *msg)
+{
+	u32 len = *(u32 *)msg->mbm_zbuf;
+	int n = -EOPNOTSUPP;
+
+	/* Never offered to peer without LZ4. */
+	if (XRT_MAILBOX_LZ4)
+		n = LZ4_decompress_safe(msg->mbm_zbuf + MSG_LZ4_HDR_SZ, msg->mbm_data,
+					msg->mbm_zlen - MSG_LZ4_HDR_SZ, msg->mbm_len);
+	kvfree(msg->mbm_zbuf);
+	msg->mbm_zbuf = NULL;
+	if (n < 0 || n != len) {
+		MBX_ERR(mbx, "failed to decompress msg (id 0x%llx): %d", msg->mbm_req_id, n);
+		return -EBADMSG;
 	}
+
+	msg->mbm_len = n;
+	return 0;
 }
 
-static inline u32 mailbox_chk_err(struct mailbox *mbx)
+/* Opcode is only known for request msgs, see struct xcl_mailbox_req. */
+static u32 msg_opcode(struct mailbox_msg *msg)
 {
-	u32 val = mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_error);
+	struct xcl_mailbox_req *req = (struct xcl_mailbox_req *)msg->mbm_data;
 
-	/* Ignore bad register value after firewall is tripped. */
-	if (val == 0xffffffff)
-		val = 0;
+	if (!(msg->mbm_flags & MSG_FLAG_REQUEST) ||
+	    msg->mbm_len < offsetofend(struct xcl_mailbox_req, req))
+		return XCL_MAILBOX_REQ_UNKNOWN;
+	return req->req;
+}
 
-	/* Error should not be seen, shout when found. */
-	if (val)
-		MBX_ERR(mbx, "mailbox error detected, error=0x%x", val);
-	return val;
+/* Opcode is only known for requests and responses we are waiting for. */
+#define MBX_TRACE_MSG(event, ch, msg)						\
+	trace_xrt_mbx_msg_##event(DEV((ch)->mbc_parent->mbx_pdev), !is_rx_chan(ch),	\
+				  (msg)->mbm_req_id, (msg)->mbm_len, (msg)->mbm_flags,	\
+				  (msg)->mbm_opcode ? (msg)->mbm_opcode : msg_opcode(msg))
+
+static inline u32 lat_bucket(u64 ns)
+{
+	return min_t(u32, fls64(ns / NSEC_PER_USEC), MBX_LAT_BUCKETS - 1);
 }
 
-static int chan_msg_enqueue(struct mailbox_channel *ch, struct mailbox_msg *msg)
+static void chan_stats_msg_done(struct mailbox_channel *ch, struct mailbox_msg *msg, int err)
 {
-	int rv = 0;
+	struct mailbox_chan_stats *st = &ch->mbc_stats;
+	u32 op = msg->mbm_opcode ? msg->mbm_opcode : msg_opcode(msg);
+	unsigned long flags;
+
+	if (op >= MBX_LAT_OPCODES)
+		op = XCL_MAILBOX_REQ_UNKNOWN;
+
+	spin_lock_irqsave(&ch->mbc_stats_lock, flags);
+	if (err == -ETIMEDOUT) {
+		st->mcs_timeouts++;
+	} else if (err) {
+		st->mcs_errors++;
+	} else {
+		st->mcs_msgs++;
+		st->mcs_bytes += msg->mbm_len;
+		st->mcs_pkts += msg->mbm_num_pkts;
+		st->mcs_lat[op][MBX_LAT_WAIT][lat_bucket(msg->mbm_start_ts - msg->mbm_enq_ts)]++;
+		st->mcs_lat[op][MBX_LAT_TOTAL][lat_bucket(msg->mbm_end_ts - msg->mbm_enq_ts)]++;
+		if (msg->mbm_striped) {
+			st->mcs_stripe_msgs++;
+			st->mcs_stripe_bytes += msg->mbm_len;
+			st->mcs_stripe_ns += msg->mbm_end_ts - msg->mbm_start_ts;
+		}
+	}
+	spin_unlock_irqrestore(&ch->mbc_stats_lock, flags);
+}
+
+static void chan_stats_inc(struct mailbox_channel *ch, u64 *counter)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ch->mbc_stats_lock, flags);
+	(*counter)++;
+	spin_unlock_irqrestore(&ch->mbc_stats_lock, flags);
+}
+
+static void mailbox_busy_nack(struct mailbox *mbx, u64 req_id, bool sw_ch);
+static void msg_stripe_done(struct mailbox_msg *seg, int err);
+
+static void msg_done(struct mailbox_msg *msg, int err)
+{
+	struct mailbox_channel *ch = msg->mbm_ch;
+	struct mailbox *mbx = ch->mbc_parent;
+
+	/* Segment is only part of a msg, which is done with the last one. */
+	if (msg->mbm_flags & MSG_FLAG_STRIPE) {
+		msg_stripe_done(msg, err);
+		return;
+	}
+
+	/* Peer has refused our request, caller can retry right away. */
+	if (!err && is_rx_msg(msg) && (msg->mbm_flags & MSG_FLAG_BUSY))
+		err = -EBUSY;
+
+	trace_xrt_mbx_msg_done(DEV(mbx->mbx_pdev), !is_rx_chan(ch), msg->mbm_req_id,
+			       msg->mbm_len, msg->mbm_opcode ? msg->mbm_opcode : msg_opcode(msg),
+			       msg->mbm_num_pkts, msg->mbm_end_ts - msg->mbm_enq_ts, err);
+
+	msg->mbm_error = err;
+	chan_stats_msg_done(ch, msg, err);
+
+	if (msg->mbm_cb) {
+		msg->mbm_cb(msg->mbm_cb_arg, msg->mbm_data, msg->mbm_len,
+			    msg->mbm_req_id, msg->mbm_error, msg->mbm_chan_sw);
+		free_msg(msg);
+		return;
+	}
+
+	if (is_rx_msg(msg) && (msg->mbm_flags & MSG_FLAG_REQUEST)) {
+		if (err) {
+			MBX_WARN(mbx, "Time'd out receiving full req message");
+			free_msg(msg);
+		} else if (mbx->mbx_req_cnt >= mbx->mbx_req_max) {
+			MBX_WARN(mbx, "Too many pending req messages, %s",
+				 mbx->mbx_busy_nack ? "refused" : "dropped");
+			chan_stats_inc(ch, &ch->mbc_stats.mcs_drops);
+			if (mbx->mbx_busy_nack)
+				mailbox_busy_nack(mbx, msg->mbm_req_id, msg->mbm_chan_sw);
+			free_msg(msg);
+		} else {
+			mutex_lock(&ch->mbc_parent->mbx_lock);
+			list_add_tail(&msg->mbm_list, &ch->mbc_parent->mbx_req_list);
+			mbx->mbx_req_cnt++;
+			mutex_unlock(&ch->mbc_parent->mbx_lock);
+			queue_work_node(mbx->mbx_node, mailbox_wq, &mbx->mbx_listen_worker);
+		}
+	} else {
+		complete(&msg->mbm_complete);
+	}
+}
+
+static struct sw_chan_msg *alloc_sw_msg(u64 id, u64 flags, size_t len)
+{
+	/* Make sure a full struct xcl_sw_chan can be copied out. */
+	struct sw_chan_msg *sm = kvmalloc(sizeof(*sm) + len, GFP_KERNEL);
+
+	if (!sm)
+		return NULL;
+
+	sm->scm_hdr.id = id;
+	sm->scm_hdr.flags = flags;
+	sm->scm_hdr.sz = len;
+	return sm;
+}
+
+static inline void free_sw_msg(struct sw_chan_msg *sm)
+{
+	kvfree(sm);
+}
+
+static void sw_chan_msg_enqueue(struct mailbox_channel *ch, struct sw_chan_msg *sm)
+{
+	WARN_ON(!mutex_is_locked(&ch->sw_chan_mutex));
+
+	list_add_tail(&sm->scm_list, &ch->sw_chan_msgs);
+	atomic_inc(&ch->sw_num_pending_msg);
+}
+
+static struct sw_chan_msg *sw_chan_msg_dequeue(struct mailbox_channel *ch)
+{
+	struct sw_chan_msg *sm;
+
+	WARN_ON(!mutex_is_locked(&ch->sw_chan_mutex));
+
+	sm = list_first_entry_or_null(&ch->sw_chan_msgs, struct sw_chan_msg, scm_list);
+	if (sm) {
+		list_del(&sm->scm_list);
+		atomic_dec(&ch->sw_num_pending_msg);
+	}
+	return sm;
+}
+
+static void reset_sw_ch(struct mailbox_channel *ch)
+{
+	struct sw_chan_msg *sm;
+
+	WARN_ON(!mutex_is_locked(&ch->sw_chan_mutex));
+
+	while ((sm = sw_chan_msg_dequeue(ch)))
+		free_sw_msg(sm);
+}
+
+#define SW_RING_MAX_PAYLOAD	\
+	(XCL_SW_CHAN_RING_SLOT_SIZE - offsetof(struct xcl_sw_chan, data))
+
+/*
+ * Software channel ring helpers, sw_chan_mutex must be held. Only head or tail
+ * owned by daemon is read from shared memory and it is never trusted.
+ */
+static inline struct xcl_sw_chan *sw_ring_slot(struct mailbox_channel *ch)
+{
+	u32 i = ch->sw_chan_ring_idx % XCL_SW_CHAN_RING_NUM_SLOTS;
+
+	return ch->sw_chan_slots + i * XCL_SW_CHAN_RING_SLOT_SIZE;
+}
+
+/* Number of slots produced, but not yet consumed. */
+static inline u32 sw_ring_used(struct mailbox_channel *ch)
+{
+	u32 cnt;
+
+	WARN_ON(!mutex_is_locked(&ch->sw_chan_mutex));
+
+	if (!ch->sw_chan_ring)
+		return 0;
+
+	if (is_rx_chan(ch)) {
+		/* Pairs with release in daemon, slot content is visible after this. */
+		cnt = smp_load_acquire(&ch->sw_chan_ring->head) - ch->sw_chan_ring_idx;
+	} else {
+		/* Pairs with release in daemon, slot can be reused after this. */
+		cnt = ch->sw_chan_ring_idx - smp_load_acquire(&ch->sw_chan_ring->tail);
+	}
+
+	/* Bad counter from daemon, treat the ring as stuck. */
+	if (cnt > XCL_SW_CHAN_RING_NUM_SLOTS)
+		cnt = is_rx_chan(ch) ? 0 : XCL_SW_CHAN_RING_NUM_SLOTS;
+	return cnt;
+}
+
+static inline bool sw_ring_fits(struct mailbox_channel *ch, size_t len)
+{
+	return ch->sw_chan_ring && len <= SW_RING_MAX_PAYLOAD;
+}
+
+static void sw_ring_attach(struct mailbox_channel *ch, struct xcl_sw_chan_shm *shm)
+{
+	struct xcl_sw_chan_ring *ring = is_rx_chan(ch) ? &shm->rx : &shm->tx;
+
+	mutex_lock(&ch->sw_chan_mutex);
+	ch->sw_chan_ring = ring;
+	ch->sw_chan_slots = (char *)shm + ring->slot_offset;
+	ch->sw_chan_ring_idx = 0;
+	mutex_unlock(&ch->sw_chan_mutex);
+}
+
+static void sw_ring_detach(struct mailbox_channel *ch)
+{
+	mutex_lock(&ch->sw_chan_mutex);
+	ch->sw_chan_ring = NULL;
+	ch->sw_chan_slots = NULL;
+	ch->sw_chan_ring_idx = 0;
+	mutex_unlock(&ch->sw_chan_mutex);
+}
+
+static void reset_hw_ch(struct mailbox_channel *ch)
+{
+	struct mailbox *mbx = ch->mbc_parent;
+
+	if (!mbx->mbx_regs)
+		return;
+
+	mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_ctrl, is_rx_chan(ch) ? 0x2 : 0x1);
+}
+
+static void chan_msg_done(struct mailbox_channel *ch, int err)
+{
+	if (!ch->mbc_cur_msg)
+		return;
+
+	ch->mbc_cur_msg->mbm_end_ts = ktime_get_ns();
+	/* Sw msg is off the sw channel queue by now, nothing to clean up. */
+	if (err && !ch->mbc_cur_msg->mbm_chan_sw)
+		reset_hw_ch(ch);
+	/* Whole compressed payload is in, msg is only usable after this. */
+	if (!err && is_rx_chan(ch) && ch->mbc_cur_msg->mbm_zbuf)
+		err = msg_decompress(ch->mbc_parent, ch->mbc_cur_msg);
+
+	msg_done(ch->mbc_cur_msg, err);
+	ch->mbc_cur_msg = NULL;
+	ch->mbc_bytes_done = 0;
+}
+
+static inline struct mailbox_msg *chan_stream_msg(struct mailbox_channel *ch, u32 sid)
+{
+	return sid == ch->mbc_stream ? ch->mbc_cur_msg : ch->mbc_streams[sid].mbs_msg;
+}
+
+/* Park current msg and pick up msg on stream @sid as the current one. */
+static void chan_stream_switch(struct mailbox_channel *ch, u32 sid)
+{
+	struct mailbox_stream *cur = &ch->mbc_streams[ch->mbc_stream];
+	struct mailbox_stream *next = &ch->mbc_streams[sid];
+
+	if (sid == ch->mbc_stream)
+		return;
+
+	cur->mbs_msg = ch->mbc_cur_msg;
+	cur->mbs_bytes_done = ch->mbc_bytes_done;
+	ch->mbc_cur_msg = next->mbs_msg;
+	ch->mbc_bytes_done = next->mbs_bytes_done;
+	next->mbs_msg = NULL;
+	next->mbs_bytes_done = 0;
+	ch->mbc_stream = sid;
+}
+
+/* Find a stream other than the current one, which has a parked msg or not. */
+static int chan_stream_find(struct mailbox_channel *ch, u32 nstreams, bool busy)
+{
+	u32 sid;
+
+	for (sid = 0; sid < nstreams; sid++) {
+		if (sid != ch->mbc_stream && !!ch->mbc_streams[sid].mbs_msg == busy)
+			return sid;
+	}
+	return -ENOENT;
+}
+
+/* Any msg being transferred on any stream? */
+static inline bool chan_busy(struct mailbox_channel *ch)
+{
+	return ch->mbc_cur_msg || chan_stream_find(ch, PKT_STREAM_NUM, true) >= 0;
+}
+
+/* Take msg off channel queue, mbc_mutex must be held. */
+static inline void chan_msg_unlink(struct mailbox_msg *msg)
+{
+	list_del_init(&msg->mbm_list);
+	hash_del(&msg->mbm_hnode);
+	msg->mbm_ch->mbc_queued--;
+	if (!RB_EMPTY_NODE(&msg->mbm_tnode)) {
+		rb_erase_cached(&msg->mbm_tnode, &msg->mbm_ch->mbc_deadlines);
+		RB_CLEAR_NODE(&msg->mbm_tnode);
+	}
+}
+
+/* Index msg by its deadline, mbc_mutex must be held. */
+static void chan_deadline_add(struct mailbox_channel *ch, struct mailbox_msg *msg)
+{
+	struct rb_node **link = &ch->mbc_deadlines.rb_root.rb_node;
+	struct rb_node *parent = NULL;
+	bool leftmost = true;
+
+	while (*link) {
+		struct mailbox_msg *temp = rb_entry(*link, struct mailbox_msg, mbm_tnode);
+
+		parent = *link;
+		if (ktime_before(msg->mbm_deadline, temp->mbm_deadline)) {
+			link = &parent->rb_left;
+		} else {
+			link = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+	rb_link_node(&msg->mbm_tnode, parent, link);
+	rb_insert_color_cached(&msg->mbm_tnode, &ch->mbc_deadlines, leftmost);
+}
+
+/*
+ * Rearm channel timer for the earliest deadline of all msgs on the channel,
+ * including the outstanding ones. Called by channel thread with mbc_mutex held.
+ */
+static void chan_timer_rearm(struct mailbox_channel *ch)
+{
+	struct rb_node *first = rb_first_cached(&ch->mbc_deadlines);
+	struct mailbox_msg *msg;
+	ktime_t next = KTIME_MAX;
+	u32 sid;
+
+	if (first)
+		next = rb_entry(first, struct mailbox_msg, mbm_tnode)->mbm_deadline;
+	for (sid = 0; sid < PKT_STREAM_NUM; sid++) {
+		msg = chan_stream_msg(ch, sid);
+		if (msg && ktime_before(msg->mbm_deadline, next))
+			next = msg->mbm_deadline;
+	}
+
+	if (next == KTIME_MAX) {
+		hrtimer_try_to_cancel(&ch->mbc_timer);
+		ch->mbc_timer_expires = KTIME_MAX;
+	} else if (next != ch->mbc_timer_expires || !hrtimer_active(&ch->mbc_timer)) {
+		ch->mbc_timer_expires = next;
+		hrtimer_start(&ch->mbc_timer, next, HRTIMER_MODE_ABS);
+	}
+}
+
+static void timeout_msg(struct mailbox_channel *ch)
+{
+	struct mailbox *mbx = ch->mbc_parent;
+	struct mailbox_msg *msg = NULL;
+	struct list_head *pos, *n;
+	struct list_head l = LIST_HEAD_INIT(l);
+	ktime_t now = ktime_get();
+	struct rb_node *first;
+	u32 sid;
+
+	/* Check outstanding msgs on all streams first. */
+	for (sid = 0; sid < PKT_STREAM_NUM; sid++) {
+		msg = chan_stream_msg(ch, sid);
+		if (!msg || ktime_before(now, msg->mbm_deadline))
+			continue;
+
+		MBX_WARN(mbx, "found outstanding msg time'd out");
+		MBX_TRACE_MSG(timeout, ch, msg);
+		if (!mbx->mbx_peer_dead) {
+			MBX_WARN(mbx, "peer becomes dead");
+			/* Peer is not active any more. */
+			mbx->mbx_peer_dead = true;
+			chan_stats_inc(ch, &ch->mbc_stats.mcs_peer_dead);
+		}
+		chan_stream_switch(ch, sid);
+		chan_msg_done(ch, -ETIMEDOUT);
+	}
+
+	mutex_lock(&ch->mbc_mutex);
+
+	/* Expired msgs are always at the front. */
+	while ((first = rb_first_cached(&ch->mbc_deadlines))) {
+		msg = rb_entry(first, struct mailbox_msg, mbm_tnode);
+		if (ktime_before(now, msg->mbm_deadline))
+			break;
+		chan_msg_unlink(msg);
+		list_add_tail(&msg->mbm_list, &l);
+	}
+	chan_timer_rearm(ch);
+
+	mutex_unlock(&ch->mbc_mutex);
+
+	if (!list_empty(&l))
+		MBX_ERR(mbx, "found awaiting msg time'd out");
+
+	list_for_each_safe(pos, n, &l) {
+		msg = list_entry(pos, struct mailbox_msg, mbm_list);
+		list_del(&msg->mbm_list);
+		MBX_TRACE_MSG(timeout, ch, msg);
+		msg_done(msg, -ETIMEDOUT);
+	}
+}
+
+/*
+ * Start counting down for msg waiting on the channel queue. If the msg is no
+ * longer on the queue, it's already being received or done, nothing to do.
+ */
+static void __msg_timer_on(struct mailbox_channel *ch, struct mailbox_msg *msg, u32 timeout_ms)
+{
+	if (!list_empty(&msg->mbm_list)) {
+		msg->mbm_deadline = ktime_add_ms(ktime_get(), timeout_ms);
+		chan_deadline_add(ch, msg);
+		chan_timer_arm(ch, msg->mbm_deadline);
+	}
+}
+
+static void msg_timer_on(struct mailbox_msg *msg, u32 timeout_ms)
+{
+	struct mailbox_channel *ch = msg->mbm_ch;
+
+	mutex_lock(&ch->mbc_mutex);
+	__msg_timer_on(ch, msg, timeout_ms);
+	mutex_unlock(&ch->mbc_mutex);
+}
+
+/*
+ * Reset deadline for outstanding msg. Next portion of the msg is expected to
+ * arrive or go out before it times out. Only called by channel thread.
+ */
+static void outstanding_msg_timer_reset(struct mailbox_channel *ch)
+{
+	struct mailbox_msg *msg = ch->mbc_cur_msg;
+
+	if (!msg)
+		return;
+
+	msg->mbm_deadline = ktime_add_ms(ktime_get(), MSG_INACTIVE_TIMEOUT_MS);
+
+	mutex_lock(&ch->mbc_mutex);
+	chan_timer_arm(ch, msg->mbm_deadline);
+	mutex_unlock(&ch->mbc_mutex);
+}
+
+static void handle_timer_event(struct mailbox_channel *ch)
+{
+	/*
+	 * Clear it before timeout_msg() re-arms the timer, or a tick firing in
+	 * between is lost and the timer is left off for good.
+	 */
+	if (!test_and_clear_bit(MBXCS_BIT_TICK, &ch->mbc_state))
+		return;
+	timeout_msg(ch);
+}
+
+/*
+ * Schedule next pass in polling mode. Busy poll right after activity, then back
+ * off exponentially. Once channel is idle, leave it to the shared poll timer.
+ */
+static void chan_poll_next(struct mailbox_channel *ch)
+{
+	struct mailbox *mbx = ch->mbc_parent;
+	u32 idle_us = jiffies_to_usecs(MAILBOX_POLL_TIMER);
+	bool busy = chan_busy(ch) || READ_ONCE(ch->mbc_queued);
+	u32 cap = busy ? min(mbx->mbx_poll_max_us, idle_us) : idle_us;
+	u32 us;
+
+	/* No more polling on a channel going away. */
+	if (test_bit(MBXCS_BIT_STOP, &ch->mbc_state))
+		return;
+
+	if (ktime_us_delta(ktime_get(), READ_ONCE(mbx->mbx_active_ts)) < mbx->mbx_poll_spin_us) {
+		chan_wakeup(ch);
+		return;
+	}
+
+	us = ch->mbc_poll_us ? ch->mbc_poll_us * 2 : mbx->mbx_poll_min_us;
+	us = clamp(us, 1U, max(cap, 1U));
+	ch->mbc_poll_us = us;
+
+	// Wait for new msg or next shared poll timer trigger
+	if (!busy && us == idle_us)
+		return;
+	hrtimer_start_range_ns(&ch->mbc_poll_timer, us_to_ktime(us),
+			       (u64)us * NSEC_PER_USEC / 2, HRTIMER_MODE_REL);
+}
+
+/*
+ * One pass of channel thread. Pkts moved in one pass are bounded, when there is
+ * more to do, the work is queued again behind works of other mailboxes sharing
+ * the same worker pool, so that one busy card can't starve the others.
+ */
+static void chan_worker(struct work_struct *work)
+{
+	struct mailbox_channel *ch = container_of(work, struct mailbox_channel, mbc_work);
+	struct mailbox *mbx;
+	bool progress;
+
+	// Channel may have been torn down, don't touch parent
+	if (test_bit(MBXCS_BIT_STOP, &ch->mbc_state))
+		return;
+	mbx = ch->mbc_parent;
+
+	progress = ch->mbc_tran(ch);
+	if (progress) {
+		WRITE_ONCE(mbx->mbx_active_ts, ktime_get());
+		ch->mbc_poll_us = 0;
+		outstanding_msg_timer_reset(ch);
+		if (mbx->mbx_peer_dead) {
+			MBX_INFO(mbx, "peer becomes active");
+			mbx->mbx_peer_dead = false;
+		}
+	}
+
+	handle_timer_event(ch);
+
+	if (progress && (MBX_IRQ_MODE(mbx) || mbx->mbx_burst)) {
+		// FIFO level may not cross threshold again, recheck after progress
+		chan_wakeup(ch);
+	} else if (!MBX_IRQ_MODE(mbx)) {
+		chan_poll_next(ch);
+	}
+}
+
+static inline u32 mailbox_chk_err(struct mailbox *mbx)
+{
+	u32 val = mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_error);
+
+	/* Ignore bad register value after firewall is tripped. */
+	if (val == 0xffffffff)
+		val = 0;
+
+	/* Error should not be seen, shout when found. */
+	if (val)
+		MBX_ERR(mbx, "mailbox error detected, error=0x%x", val);
+	return val;
+}
+
+/* Get msg ready to be queued up, before mbc_mutex is taken. */
+static void chan_msg_prep(struct mailbox_channel *ch, struct mailbox_msg *msg)
+{
+	if (!is_rx_chan(ch))
+		msg_compress(ch->mbc_parent, msg);
+
+	/* Small msgs to peer jump ahead of big ones. */
+	if (!is_rx_chan(ch) && msg_wire_len(msg) <= MSG_PRIO_HIGH_MAX_SZ)
+		msg->mbm_prio = MSG_PRIO_HIGH;
+	else
+		msg->mbm_prio = MSG_PRIO_NORMAL;
+}
+
+/* Queue up prepared msg, mbc_mutex must be held and channel not stopped. */
+static void __chan_msg_enqueue(struct mailbox_channel *ch, struct mailbox_msg *msg)
+{
+	list_add_tail(&msg->mbm_list, &ch->mbc_msgs[msg->mbm_prio]);
+	/* Response is matched by ID when it comes in. */
+	if (is_rx_chan(ch))
+		hash_add(ch->mbc_msg_hash, &msg->mbm_hnode, msg->mbm_req_id);
+	msg->mbm_ch = ch;
+	msg->mbm_enq_ts = ktime_get_ns();
+	ch->mbc_queued++;
+	MBX_TRACE_MSG(enqueue, ch, msg);
+}
+
+static int chan_msg_enqueue_striped(struct mailbox_channel *ch, struct mailbox_msg *msg);
+
+static int chan_msg_enqueue(struct mailbox_channel *ch, struct mailbox_msg *msg)
+{
+	int rv = 0;
 
 	MBX_DBG(ch->mbc_parent, "%s enqueuing msg, id=0x%llx", ch_name(ch), msg->mbm_req_id);
 	WARN_ON(msg->mbm_req_id == INVALID_MSG_ID);
 
+	/* Big msg may go out in segments, it's sent as a whole if we run out of memory. */
+	if (!is_rx_chan(ch) && msg_stripe_wanted(ch->mbc_parent, msg)) {
+		rv = chan_msg_enqueue_striped(ch, msg);
+		if (rv != -ENOMEM)
+			return rv;
+		rv = 0;
+	}
+
+	chan_msg_prep(ch, msg);
+
 	mutex_lock(&ch->mbc_mutex);
-	if (test_bit(MBXCS_BIT_STOP, &ch->mbc_state)) {
+	if (test_bit(MBXCS_BIT_STOP, &ch->mbc_state))
 		rv = -ESHUTDOWN;
-	} else {
-		list_add_tail(&msg->mbm_list, &ch->mbc_msgs);
-		msg->mbm_ch = ch;
-	}
+	else
+		__chan_msg_enqueue(ch, msg);
 	mutex_unlock(&ch->mbc_mutex);
 
+	/* Don't wait for next timer tick to start working on it. */
+	if (!rv)
+		chan_wakeup(ch);
+
 	return rv;
 }
 
+/*
+ * Pick the next msg to send. High prio msg goes first, unless normal ones have
+ * been waiting for too long.
+ */
+static struct mailbox_msg *chan_msg_first(struct mailbox_channel *ch)
+{
+	struct mailbox_msg *hi, *lo;
+
+	hi = list_first_entry_or_null(&ch->mbc_msgs[MSG_PRIO_HIGH], struct mailbox_msg, mbm_list);
+	lo = list_first_entry_or_null(&ch->mbc_msgs[MSG_PRIO_NORMAL], struct mailbox_msg, mbm_list);
+
+	if (hi && (!lo || ch->mbc_hi_streak < MSG_PRIO_HIGH_MAX_STREAK)) {
+		if (lo)
+			ch->mbc_hi_streak++;
+		return hi;
+	}
+
+	ch->mbc_hi_streak = 0;
+	return lo;
+}
+
+/* Look up queued msg by ID, mbc_mutex must be held. Only RX msgs are indexed. */
+static struct mailbox_msg *__chan_msg_find(struct mailbox_channel *ch, u64 req_id)
+{
+	struct mailbox_msg *temp;
+
+	WARN_ON(!is_rx_chan(ch));
+	hash_for_each_possible(ch->mbc_msg_hash, temp, mbm_hnode, req_id) {
+		if (temp->mbm_req_id == req_id)
+			return temp;
+	}
+	return NULL;
+}
+
 static struct mailbox_msg *chan_msg_dequeue(struct mailbox_channel *ch, u64 req_id)
 {
 	struct mailbox_msg *msg = NULL;
-	struct list_head *pos;
 
 	mutex_lock(&ch->mbc_mutex);
 
 	/* Take the first msg. */
-	if (req_id == INVALID_MSG_ID) {
-		msg = list_first_entry_or_null(&ch->mbc_msgs, struct mailbox_msg, mbm_list);
+	if (req_id == INVALID_MSG_ID)
+		msg = chan_msg_first(ch);
 	/* Take the msg w/ specified ID. */
-	} else {
-		list_for_each(pos, &ch->mbc_msgs) {
-			struct mailbox_msg *temp;
-
-			temp = list_entry(pos, struct mailbox_msg, mbm_list);
-			if (temp->mbm_req_id == req_id) {
-				msg = temp;
-				break;
-			}
-		}
-	}
+	else
+		msg = __chan_msg_find(ch, req_id);
 
 	if (msg) {
 		MBX_DBG(ch->mbc_parent, "%s dequeued msg, id=0x%llx", ch_name(ch), msg->mbm_req_id);
-		list_del(&msg->mbm_list);
+		chan_msg_unlink(msg);
 	}
 
 	mutex_unlock(&ch->mbc_mutex);
@@ -664,31 +1766,154 @@ static struct mailbox_msg *alloc_msg(void *buf, size_t len)
 	/* Give MB*2 secs as time to live */
 
 	if (!buf) {
-		msg = vzalloc(sizeof(*msg) + len);
+		msg = mailbox_msg_zalloc(len);
 		if (!msg)
 			return NULL;
 		newbuf = ((char *)msg) + sizeof(struct mailbox_msg);
 	} else {
-		msg = vzalloc(sizeof(*msg));
+		msg = mailbox_msg_zalloc(0);
 		if (!msg)
 			return NULL;
 		newbuf = buf;
 	}
 
 	INIT_LIST_HEAD(&msg->mbm_list);
+	INIT_HLIST_NODE(&msg->mbm_hnode);
 	msg->mbm_data = newbuf;
 	msg->mbm_len = len;
-	atomic_set(&msg->mbm_ttl, MSG_MAX_TTL);
+	RB_CLEAR_NODE(&msg->mbm_tnode);
+	msg->mbm_deadline = KTIME_MAX;
 	msg->mbm_chan_sw = false;
 	init_completion(&msg->mbm_complete);
 
 	return msg;
 }
 
-static void chan_fini(struct mailbox_channel *ch)
+static void mailbox_busy_nack_sent(void *arg, void *data, size_t len,
+				   u64 msgid, int err, bool sw_ch)
 {
-	struct mailbox_msg *msg;
+	if (err)
+		MBX_DBG((struct mailbox *)arg, "failed to refuse req (id 0x%llx): %d", msgid, err);
+}
+
+/*
+ * Tell peer that its request is refused, so that it doesn't have to wait till
+ * time out. Payload is an error code, as for most of the responses.
+ */
+static void mailbox_busy_nack(struct mailbox *mbx, u64 req_id, bool sw_ch)
+{
+	struct mailbox_msg *msg = alloc_msg(NULL, sizeof(int));
+
+	if (!msg)
+		return;
+
+	*(int *)msg->mbm_data = -EBUSY;
+	msg->mbm_req_id = req_id;
+	msg->mbm_chan_sw = sw_ch;
+	msg->mbm_flags |= MSG_FLAG_RESPONSE | MSG_FLAG_BUSY;
+	msg->mbm_cb = mailbox_busy_nack_sent;
+	msg->mbm_cb_arg = mbx;
+	if (chan_msg_enqueue(&mbx->mbx_tx, msg))
+		free_msg(msg);
+}
+
+/* Cut @len bytes at @off out of TX msg as a segment. */
+static struct mailbox_msg *msg_stripe_seg(struct mailbox_msg *msg, u32 off, u32 len, bool sw)
+{
+	struct mailbox_msg *seg = alloc_msg(NULL, MSG_STRIPE_HDR_SZ + len);
+	struct mailbox_stripe_hdr *hdr;
+
+	if (!seg)
+		return NULL;
+
+	hdr = (struct mailbox_stripe_hdr *)seg->mbm_data;
+	hdr->msh_offset = off;
+	hdr->msh_total = msg->mbm_len;
+	memcpy(seg->mbm_data + MSG_STRIPE_HDR_SZ, msg->mbm_data + off, len);
+	seg->mbm_req_id = msg->mbm_req_id;
+	seg->mbm_flags = msg->mbm_flags | MSG_FLAG_STRIPE;
+	seg->mbm_chan_sw = sw;
+	seg->mbm_opcode = msg_opcode(msg);
+	seg->mbm_stripe_parent = msg;
+	return seg;
+}
+
+/*
+ * Send TX msg as one segment on SW channel followed by one on HW channel. The
+ * former is handed over to daemon right away, so both are on the wire at the
+ * same time. Msg itself is never queued up, it's done with its last segment.
+ */
+static int chan_msg_enqueue_striped(struct mailbox_channel *ch, struct mailbox_msg *msg)
+{
+	struct mailbox *mbx = ch->mbc_parent;
+	struct mailbox_msg *segs[2];
+	u32 swlen;
+	int i, rv = 0;
+
+	swlen = div_u64((u64)msg->mbm_len * mbx->mbx_stripe_sw_pct, 100);
+	swlen = clamp_t(u32, swlen, 1, msg->mbm_len - 1);
+	segs[0] = msg_stripe_seg(msg, 0, swlen, true);
+	segs[1] = msg_stripe_seg(msg, swlen, msg->mbm_len - swlen, false);
+	if (!segs[0] || !segs[1]) {
+		rv = -ENOMEM;
+		goto fail;
+	}
+
+	msg->mbm_ch = ch;
+	msg->mbm_enq_ts = ktime_get_ns();
+	msg->mbm_start_ts = 0;
+	msg->mbm_num_pkts = 0;
+	msg->mbm_error = 0;
+	msg->mbm_striped = true;
+	atomic_set(&msg->mbm_stripe_left, ARRAY_SIZE(segs));
+	for (i = 0; i < ARRAY_SIZE(segs); i++)
+		chan_msg_prep(ch, segs[i]);
+
+	/* All or nothing, msg can't be done with only part of it queued up. */
+	mutex_lock(&ch->mbc_mutex);
+	if (test_bit(MBXCS_BIT_STOP, &ch->mbc_state)) {
+		rv = -ESHUTDOWN;
+	} else {
+		for (i = 0; i < ARRAY_SIZE(segs); i++)
+			__chan_msg_enqueue(ch, segs[i]);
+	}
+	mutex_unlock(&ch->mbc_mutex);
+	if (rv)
+		goto fail;
+
+	chan_wakeup(ch);
+	return 0;
 
+fail:
+	for (i = 0; i < ARRAY_SIZE(segs); i++) {
+		if (segs[i])
+			free_msg(segs[i]);
+	}
+	return rv;
+}
+
+/* TX segment is done, so is the striped msg if it's the last one. */
+static void msg_stripe_tx_done(struct mailbox_msg *seg, int err)
+{
+	struct mailbox_msg *msg = seg->mbm_stripe_parent;
+
+	if (err)
+		cmpxchg(&msg->mbm_error, 0, err);
+	if (seg->mbm_start_ts && (!msg->mbm_start_ts || seg->mbm_start_ts < msg->mbm_start_ts))
+		msg->mbm_start_ts = seg->mbm_start_ts;
+	msg->mbm_num_pkts += seg->mbm_num_pkts;
+	free_msg(seg);
+
+	if (!atomic_dec_and_test(&msg->mbm_stripe_left))
+		return;
+
+	msg->mbm_end_ts = ktime_get_ns();
+	msg_done(msg, msg->mbm_error);
+}
+
+/* Stop channel thread, can be called multiple times. */
+static void chan_stop(struct mailbox_channel *ch)
+{
 	if (!ch->mbc_parent)
 		return;
 
@@ -700,20 +1925,34 @@ static void chan_fini(struct mailbox_channel *ch)
 	set_bit(MBXCS_BIT_STOP, &ch->mbc_state);
 	mutex_unlock(&ch->mbc_mutex);
 
-	if (ch->mbc_wq) {
-		complete(&ch->mbc_worker);
-		cancel_work_sync(&ch->mbc_work);
-		destroy_workqueue(ch->mbc_wq);
-	}
+	/*
+	 * No more kick after STOP, except for the ones in flight. Worker may
+	 * still arm poll timer till it's done, so cancel the timer after it.
+	 */
+	cancel_work_sync(&ch->mbc_work);
+	hrtimer_cancel(&ch->mbc_poll_timer);
+}
+
+static void chan_fini(struct mailbox_channel *ch)
+{
+	struct mailbox_msg *msg;
+	u32 sid;
+
+	if (!ch->mbc_parent)
+		return;
+
+	chan_stop(ch);
+	hrtimer_cancel(&ch->mbc_timer);
+	hrtimer_cancel(&ch->mbc_poll_timer);
 
 	mutex_lock(&ch->sw_chan_mutex);
-	if (ch->sw_chan_buf)
-		vfree(ch->sw_chan_buf);
+	reset_sw_ch(ch);
 	mutex_unlock(&ch->sw_chan_mutex);
 
-	msg = ch->mbc_cur_msg;
-	if (msg)
+	for (sid = 0; sid < PKT_STREAM_NUM; sid++) {
+		chan_stream_switch(ch, sid);
 		chan_msg_done(ch, -ESHUTDOWN);
+	}
 
 	while ((msg = chan_msg_dequeue(ch, INVALID_MSG_ID)))
 		msg_done(msg, -ESHUTDOWN);
@@ -726,18 +1965,35 @@ static void chan_fini(struct mailbox_channel *ch)
 static int chan_init(struct mailbox *mbx, enum mailbox_chan_type type,
 		     struct mailbox_channel *ch, chan_func_t fn)
 {
+	int prio;
+
 	ch->mbc_parent = mbx;
 	ch->mbc_type = type;
 	ch->mbc_tran = fn;
-	INIT_LIST_HEAD(&ch->mbc_msgs);
-	init_completion(&ch->mbc_worker);
+	for (prio = 0; prio < MSG_PRIO_NUM; prio++)
+		INIT_LIST_HEAD(&ch->mbc_msgs[prio]);
+	hash_init(ch->mbc_msg_hash);
+	ch->mbc_queued = 0;
+	spin_lock_init(&ch->mbc_stats_lock);
+	memset(&ch->mbc_stats, 0, sizeof(ch->mbc_stats));
+	ch->mbc_deadlines = RB_ROOT_CACHED;
+	hrtimer_init(&ch->mbc_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	ch->mbc_timer.function = chan_timer;
+	ch->mbc_timer_expires = KTIME_MAX;
+	hrtimer_init(&ch->mbc_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ch->mbc_poll_timer.function = chan_poll_timer;
+	ch->mbc_poll_us = 0;
+	ch->mbc_hi_streak = 0;
 	mutex_init(&ch->mbc_mutex);
 	mutex_init(&ch->sw_chan_mutex);
+	INIT_LIST_HEAD(&ch->sw_chan_msgs);
 
 	init_waitqueue_head(&ch->sw_chan_wq);
 	atomic_set(&ch->sw_num_pending_msg, 0);
 	ch->mbc_cur_msg = NULL;
 	ch->mbc_bytes_done = 0;
+	memset(ch->mbc_streams, 0, sizeof(ch->mbc_streams));
+	ch->mbc_stream = 0;
 
 	/* Reset pkt buffer. */
 	reset_pkt(&ch->mbc_packet);
@@ -748,66 +2004,69 @@ static int chan_init(struct mailbox *mbx, enum mailbox_chan_type type,
 	reset_sw_ch(ch);
 	mutex_unlock(&ch->sw_chan_mutex);
 
-	/* One thread for one channel. */
-	ch->mbc_wq = create_singlethread_workqueue(dev_name(&mbx->mbx_pdev->dev));
-	if (!ch->mbc_wq) {
-		chan_fini(ch);
-		return -ENOMEM;
-	}
+	/* Channel thread is one work on the shared workqueue, near the card. */
 	INIT_WORK(&ch->mbc_work, chan_worker);
+	ch->mbc_node = mbx->mbx_node;
 
 	/* Kick off channel thread, all initialization should be done by now. */
 	clear_bit(MBXCS_BIT_STOP, &ch->mbc_state);
 	set_bit(MBXCS_BIT_READY, &ch->mbc_state);
-	queue_work(ch->mbc_wq, &ch->mbc_work);
+	chan_wakeup(ch);
 	return 0;
 }
 
 static void listen_wq_fini(struct mailbox *mbx)
 {
-	if (mbx->mbx_listen_wq) {
-		mbx->mbx_listen_stop = true;
-		complete(&mbx->mbx_comp);
-		cancel_work_sync(&mbx->mbx_listen_worker);
-		destroy_workqueue(mbx->mbx_listen_wq);
-		mbx->mbx_listen_wq = NULL;
+	struct mailbox_msg *msg;
+
+	WRITE_ONCE(mbx->mbx_listen_stop, true);
+	cancel_work_sync(&mbx->mbx_listen_worker);
+
+	/* Drain all msg before quit. */
+	mutex_lock(&mbx->mbx_lock);
+	while ((msg = list_first_entry_or_null(&mbx->mbx_req_list, struct mailbox_msg, mbm_list))) {
+		list_del(&msg->mbm_list);
+		mbx->mbx_req_cnt--;
+		free_msg(msg);
 	}
+	mutex_unlock(&mbx->mbx_lock);
 }
 
 static void chan_recv_pkt(struct mailbox_channel *ch)
 {
-	int i, retry = 10;
 	struct mailbox *mbx = ch->mbc_parent;
 	struct mailbox_pkt *pkt = &ch->mbc_packet;
 
 	WARN_ON(valid_pkt(pkt));
 
-	/* Picking up a packet from HW. */
-	for (i = 0; i < PACKET_SIZE; i++) {
-		while ((mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_status) & STATUS_EMPTY) &&
-		       (retry-- > 0))
-			msleep(100);
+	/*
+	 * Picking up a packet from HW. Caller has seen RTA, so a full packet is
+	 * already sitting in the FIFO, no need to check status for each DWORD.
+	 */
+	if (mbx->mbx_sim)
+		sim_fifo_rd(mbx, (u32 *)pkt, PACKET_SIZE);
+	else
+		ioread32_rep(&mbx->mbx_regs->mbr_rddata, pkt, PACKET_SIZE);
 
-		*(((u32 *)pkt) + i) = mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_rddata);
-	}
 	if ((mailbox_chk_err(mbx) & STATUS_EMPTY) != 0)
 		reset_pkt(pkt);
 	else
-		MBX_DBG(mbx, "received pkt: type=0x%x", pkt->hdr.type);
+		trace_xrt_mbx_pkt_recv(DEV(mbx->mbx_pdev), pkt->hdr.type, pkt->hdr.payload_size);
 }
 
 static void chan_send_pkt(struct mailbox_channel *ch)
 {
 	struct mailbox_pkt *pkt = &ch->mbc_packet;
 	struct mailbox *mbx = ch->mbc_parent;
-	int i;
 
 	WARN_ON(!valid_pkt(pkt));
-	MBX_DBG(mbx, "sending pkt: type=0x%x", pkt->hdr.type);
+	trace_xrt_mbx_pkt_send(DEV(mbx->mbx_pdev), pkt->hdr.type, pkt->hdr.payload_size);
 
 	/* Pushing a packet into HW. */
-	for (i = 0; i < PACKET_SIZE; i++)
-		mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_wrdata, *(((u32 *)pkt) + i));
+	if (mbx->mbx_sim)
+		sim_fifo_wr(mbx, (u32 *)pkt, PACKET_SIZE);
+	else
+		iowrite32_rep(&mbx->mbx_regs->mbr_wrdata, pkt, PACKET_SIZE);
 
 	reset_pkt(pkt);
 	if (ch->mbc_cur_msg)
@@ -824,24 +2083,26 @@ static int chan_pkt2msg(struct mailbox_channel *ch)
 	size_t cnt = pkt->hdr.payload_size;
 	u32 type = (pkt->hdr.type & PKT_TYPE_MASK);
 	void *msg_data, *pkt_data;
+	size_t *len;
 
 	WARN_ON(((type != PKT_MSG_START) && (type != PKT_MSG_BODY)) || !msg);
+	len = msg->mbm_zbuf ? &msg->mbm_zlen : &msg->mbm_len;
 
 	if (type == PKT_MSG_START) {
 		msg->mbm_req_id = pkt->body.msg_start.msg_req_id;
-		WARN_ON(msg->mbm_len < pkt->body.msg_start.msg_size);
-		msg->mbm_len = pkt->body.msg_start.msg_size;
+		WARN_ON(*len < pkt->body.msg_start.msg_size);
+		*len = pkt->body.msg_start.msg_size;
 		pkt_data = pkt->body.msg_start.payload;
 	} else {
 		pkt_data = pkt->body.msg_body.payload;
 	}
 
-	if (cnt > msg->mbm_len - ch->mbc_bytes_done) {
+	if (cnt > *len - ch->mbc_bytes_done) {
 		MBX_ERR(mbx, "invalid mailbox packet size");
 		return -EBADMSG;
 	}
 
-	msg_data = msg->mbm_data + ch->mbc_bytes_done;
+	msg_data = msg_wire_data(msg) + ch->mbc_bytes_done;
 	memcpy(msg_data, pkt_data, cnt);
 	ch->mbc_bytes_done += cnt;
 	msg->mbm_num_pkts++;
@@ -850,55 +2111,314 @@ static int chan_pkt2msg(struct mailbox_channel *ch)
 	return 0;
 }
 
-/* Prepare outstanding msg for receiving incoming msg. */
-static void dequeue_rx_msg(struct mailbox_channel *ch, u32 flags, u64 id, size_t sz)
+/* New msg for incoming one nobody is waiting for. */
+static struct mailbox_msg *rx_msg_alloc(struct mailbox_channel *ch, u32 flags, u64 id, size_t sz)
+{
+	struct mailbox_msg *msg = alloc_msg(NULL, sz);
+
+	if (msg) {
+		msg->mbm_req_id = id;
+		msg->mbm_ch = ch;
+		msg->mbm_flags = flags;
+		msg->mbm_enq_ts = ktime_get_ns();
+	}
+	return msg;
+}
+
+/*
+ * Find or allocate msg for receiving incoming msg. Returns NULL if it's dropped.
+ * On error, msg is returned to be failed by caller.
+ */
+static struct mailbox_msg *rx_msg_get(struct mailbox_channel *ch, u32 flags, u64 id,
+				      size_t sz, int *err)
 {
 	struct mailbox *mbx = ch->mbc_parent;
 	struct mailbox_msg *msg = NULL;
-	int err = 0;
-
-	if (ch->mbc_cur_msg)
-		return;
 
-	if (flags & MSG_FLAG_RESPONSE) {
+	*err = 0;
+	if (flags & MSG_FLAG_STRIPE) {
+		/* Segment is put together with the others in msg_stripe_rx_done(). */
+		if (mbx->mbx_stripe && sz > MSG_STRIPE_HDR_SZ &&
+		    sz <= MSG_STRIPE_HDR_SZ + MBX_STRIPE_MAX_SZ)
+			msg = rx_msg_alloc(ch, flags, id, sz);
+		if (!msg) {
+			MBX_ERR(mbx, "segment len %luB is invalid", sz);
+			chan_stats_inc(ch, &ch->mbc_stats.mcs_drops);
+		}
+	} else if (flags & MSG_FLAG_RESPONSE) {
 		msg = chan_msg_dequeue(ch, id);
 		if (!msg) {
 			MBX_ERR(mbx, "Failed to find msg (id 0x%llx)", id);
+			chan_stats_inc(ch, &ch->mbc_stats.mcs_drops);
 		} else if (msg->mbm_len < sz) {
 			MBX_ERR(mbx, "Response (id 0x%llx) is too big: %lu", id, sz);
-			err = -EMSGSIZE;
+			*err = -EMSGSIZE;
+		} else {
+			msg->mbm_flags |= flags & MSG_FLAG_BUSY;
 		}
 	} else if (flags & MSG_FLAG_REQUEST) {
 		if (sz < MAX_REQ_MSG_SZ)
-			msg = alloc_msg(NULL, sz);
-		if (msg) {
-			msg->mbm_req_id = id;
-			msg->mbm_ch = ch;
-			msg->mbm_flags = flags;
-		} else {
+			msg = rx_msg_alloc(ch, flags, id, sz);
+		if (!msg) {
 			MBX_ERR(mbx, "req msg len %luB is too big", sz);
+			chan_stats_inc(ch, &ch->mbc_stats.mcs_drops);
 		}
 	} else {
 		/* Not a request or response? */
 		MBX_ERR(mbx, "Invalid incoming msg flags: 0x%x", flags);
 	}
 
-	if (msg) {
-		msg->mbm_start_ts = ktime_get_ns();
-		msg->mbm_num_pkts = 0;
-		ch->mbc_cur_msg = msg;
+	return msg;
+}
+
+/* Prepare outstanding msg for receiving incoming msg. */
+static void dequeue_rx_msg(struct mailbox_channel *ch, u32 flags, u64 id, size_t sz)
+{
+	struct mailbox_msg *msg;
+	int err;
+
+	if (ch->mbc_cur_msg)
+		return;
+
+	msg = rx_msg_get(ch, flags, id, sz, &err);
+	if (msg) {
+		msg->mbm_start_ts = ktime_get_ns();
+		msg->mbm_num_pkts = 0;
+		ch->mbc_cur_msg = msg;
+		MBX_TRACE_MSG(dequeue, ch, msg);
+		outstanding_msg_timer_reset(ch);
+	}
+
+	/* Fail received msg now on error. */
+	if (err)
+		chan_msg_done(ch, err);
+}
+
+static void mailbox_stripe_free(struct mailbox *mbx, struct mailbox_stripe *st)
+{
+	list_del(&st->mst_list);
+	mbx->mbx_stripe_cnt--;
+	kvfree(st->mst_buf);
+	kfree(st);
+}
+
+static void mailbox_stripe_fini(struct mailbox *mbx)
+{
+	struct mailbox_stripe *st, *next;
+
+	list_for_each_entry_safe(st, next, &mbx->mbx_stripes, mst_list)
+		mailbox_stripe_free(mbx, st);
+}
+
+static struct mailbox_stripe *mailbox_stripe_find(struct mailbox *mbx, u64 id, u32 flags)
+{
+	struct mailbox_stripe *st;
+
+	list_for_each_entry(st, &mbx->mbx_stripes, mst_list) {
+		if (st->mst_id == id && st->mst_flags == flags)
+			return st;
+	}
+	return NULL;
+}
+
+static struct mailbox_stripe *mailbox_stripe_alloc(struct mailbox *mbx, u64 id, u32 flags,
+						   u32 total)
+{
+	struct mailbox_stripe *st;
+
+	/* Peer may never send the rest of the oldest one, make room for new one. */
+	if (mbx->mbx_stripe_cnt >= MBX_STRIPE_MAX_PENDING) {
+		st = list_first_entry(&mbx->mbx_stripes, struct mailbox_stripe, mst_list);
+		MBX_WARN(mbx, "Dropped incomplete striped msg (id 0x%llx)", st->mst_id);
+		chan_stats_inc(&mbx->mbx_rx, &mbx->mbx_rx.mbc_stats.mcs_drops);
+		mailbox_stripe_free(mbx, st);
+	}
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return NULL;
+	st->mst_buf = kvzalloc(total, GFP_KERNEL);
+	if (!st->mst_buf) {
+		kfree(st);
+		return NULL;
+	}
+	st->mst_id = id;
+	st->mst_flags = flags;
+	st->mst_total = total;
+	list_add_tail(&st->mst_list, &mbx->mbx_stripes);
+	mbx->mbx_stripe_cnt++;
+	return st;
+}
+
+/* All segments are in, hand striped msg over as if it's received in one piece. */
+static void msg_stripe_deliver(struct mailbox_channel *ch, struct mailbox_stripe *st)
+{
+	struct mailbox_msg *msg;
+	int err;
+
+	msg = rx_msg_get(ch, st->mst_flags, st->mst_id, st->mst_total, &err);
+	if (!msg)
+		return;
+
+	if (!err)
+		memcpy(msg->mbm_data, st->mst_buf, st->mst_total);
+	msg->mbm_enq_ts = min(msg->mbm_enq_ts, st->mst_start_ts);
+	msg->mbm_start_ts = st->mst_start_ts;
+	msg->mbm_end_ts = ktime_get_ns();
+	msg->mbm_num_pkts = st->mst_num_pkts;
+	msg->mbm_striped = true;
+	MBX_TRACE_MSG(dequeue, ch, msg);
+	msg_done(msg, err);
+}
+
+/*
+ * Max size of a new striped msg. Response can't be bigger than the msg waiting
+ * for it, nor request bigger than what's taken in one piece (see rx_msg_get()).
+ */
+static u32 mailbox_stripe_max(struct mailbox *mbx, u64 id, u32 flags)
+{
+	struct mailbox_channel *ch = &mbx->mbx_rx;
+	struct mailbox_msg *msg;
+	u32 max = 0;
+
+	if (flags & MSG_FLAG_RESPONSE) {
+		mutex_lock(&ch->mbc_mutex);
+		msg = __chan_msg_find(ch, id);
+		if (msg)
+			max = min_t(size_t, msg->mbm_len, MBX_STRIPE_MAX_SZ);
+		mutex_unlock(&ch->mbc_mutex);
+	} else if (flags & MSG_FLAG_REQUEST) {
+		max = MAX_REQ_MSG_SZ - 1;
+	}
+	return max;
+}
+
+/* Check if segment overlaps any of those already received. */
+static bool mailbox_stripe_overlap(struct mailbox_stripe *st, u32 off, u32 len)
+{
+	u32 i;
+
+	for (i = 0; i < st->mst_nsegs; i++) {
+		if (off < st->mst_segs[i].off + st->mst_segs[i].len &&
+		    st->mst_segs[i].off < off + len)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * RX segment is done, put it together with others. Only called by RX thread.
+ * Segments never overlap, so msg is complete once all bytes are received.
+ */
+static void msg_stripe_rx_done(struct mailbox_msg *seg, int err)
+{
+	struct mailbox_channel *ch = seg->mbm_ch;
+	struct mailbox *mbx = ch->mbc_parent;
+	struct mailbox_stripe_hdr *hdr = (struct mailbox_stripe_hdr *)seg->mbm_data;
+	u32 flags = seg->mbm_flags & ~(MSG_FLAG_STRIPE | MSG_FLAG_LZ4);
+	u32 len = seg->mbm_len - MSG_STRIPE_HDR_SZ;
+	struct mailbox_stripe *st;
+
+	st = mailbox_stripe_find(mbx, seg->mbm_req_id, flags);
+	if (!err && (!hdr->msh_total || hdr->msh_total > MBX_STRIPE_MAX_SZ ||
+		     len > hdr->msh_total || hdr->msh_offset > hdr->msh_total - len ||
+		     (st && (st->mst_total != hdr->msh_total ||
+			     len > st->mst_total - st->mst_received ||
+			     st->mst_nsegs >= MBX_STRIPE_MAX_SEGS ||
+			     mailbox_stripe_overlap(st, hdr->msh_offset, len))) ||
+		     (!st && hdr->msh_total > mailbox_stripe_max(mbx, seg->mbm_req_id, flags)))) {
+		MBX_ERR(mbx, "Invalid segment of striped msg (id 0x%llx)", seg->mbm_req_id);
+		err = -EBADMSG;
+	}
+	if (!err && !st) {
+		st = mailbox_stripe_alloc(mbx, seg->mbm_req_id, flags, hdr->msh_total);
+		if (!st)
+			err = -ENOMEM;
+	}
+	if (err) {
+		/* Msg can't be put together anymore. */
+		if (st)
+			mailbox_stripe_free(mbx, st);
+		chan_stats_inc(ch, &ch->mbc_stats.mcs_drops);
+		free_msg(seg);
+		return;
+	}
+
+	memcpy(st->mst_buf + hdr->msh_offset, seg->mbm_data + MSG_STRIPE_HDR_SZ, len);
+	st->mst_segs[st->mst_nsegs].off = hdr->msh_offset;
+	st->mst_segs[st->mst_nsegs].len = len;
+	st->mst_nsegs++;
+	st->mst_received += len;
+	st->mst_num_pkts += seg->mbm_num_pkts;
+	if (!st->mst_start_ts || seg->mbm_start_ts < st->mst_start_ts)
+		st->mst_start_ts = seg->mbm_start_ts;
+	free_msg(seg);
+
+	if (st->mst_received < st->mst_total)
+		return;
+
+	msg_stripe_deliver(ch, st);
+	mailbox_stripe_free(mbx, st);
+}
+
+static void msg_stripe_done(struct mailbox_msg *seg, int err)
+{
+	if (is_rx_msg(seg))
+		msg_stripe_rx_done(seg, err);
+	else
+		msg_stripe_tx_done(seg, err);
+}
+
+/* Receive one msg from the shared ring, if any. */
+static bool do_sw_rx_ring(struct mailbox_channel *ch)
+{
+	struct mailbox *mbx = ch->mbc_parent;
+	struct xcl_sw_chan *slot;
+	u64 id, flags, len;
+
+	/*
+	 * Hold the lock so that the ring can't go away underneath us. The slot
+	 * is owned by us until tail is moved, but header is still snapshotted
+	 * in case daemon misbehaves.
+	 */
+	mutex_lock(&ch->sw_chan_mutex);
+
+	if (!sw_ring_used(ch)) {
+		mutex_unlock(&ch->sw_chan_mutex);
+		return false;
+	}
+
+	slot = sw_ring_slot(ch);
+	id = READ_ONCE(slot->id);
+	flags = READ_ONCE(slot->flags);
+	len = READ_ONCE(slot->sz);
+	if (id == 0 || len == 0 || len > SW_RING_MAX_PAYLOAD) {
+		MBX_ERR(mbx, "Software RX ring has malformed msg header");
+	} else {
+		dequeue_rx_msg(ch, flags, id, len);
+		if (ch->mbc_cur_msg) {
+			ch->mbc_cur_msg->mbm_chan_sw = true;
+			memcpy(ch->mbc_cur_msg->mbm_data, slot->data, len);
+		}
 	}
 
-	/* Fail received msg now on error. */
-	if (err)
-		chan_msg_done(ch, err);
+	/* Done with the slot, hand it back to daemon. */
+	ch->sw_chan_ring_idx++;
+	/* Make sure all reads from the slot are done before daemon reuses it. */
+	smp_store_release(&ch->sw_chan_ring->tail, ch->sw_chan_ring_idx);
+
+	mutex_unlock(&ch->sw_chan_mutex);
+
+	wake_up_interruptible(&ch->sw_chan_wq);
+
+	chan_msg_done(ch, 0);
+
+	return true;
 }
 
 static bool do_sw_rx(struct mailbox_channel *ch)
 {
-	size_t len = 0;
-	u32 flags = 0;
-	u64 id = 0;
+	struct sw_chan_msg *sm;
 
 	/*
 	 * Don't receive new msg when a msg is being received from HW
@@ -908,65 +2428,80 @@ static bool do_sw_rx(struct mailbox_channel *ch)
 		return false;
 
 	mutex_lock(&ch->sw_chan_mutex);
-
-	flags = ch->sw_chan_msg_flags;
-	id = ch->sw_chan_msg_id;
-	len = ch->sw_chan_buf_sz;
-
+	sm = sw_chan_msg_dequeue(ch);
 	mutex_unlock(&ch->sw_chan_mutex);
 
-	/* Nothing to receive. */
-	if (id == 0)
-		return false;
-
-	/* Prepare outstanding msg. */
-	dequeue_rx_msg(ch, flags, id, len);
-
-	mutex_lock(&ch->sw_chan_mutex);
+	/* Nothing to receive from write(), try the shared ring. */
+	if (!sm)
+		return do_sw_rx_ring(ch);
 
-	WARN_ON(id != ch->sw_chan_msg_id);
+	/* There is room in the queue now. */
+	wake_up_interruptible(&ch->sw_chan_wq);
 
+	/* Prepare outstanding msg. */
+	dequeue_rx_msg(ch, sm->scm_hdr.flags, sm->scm_hdr.id, sm->scm_hdr.sz);
 	if (ch->mbc_cur_msg) {
 		ch->mbc_cur_msg->mbm_chan_sw = true;
-		memcpy(ch->mbc_cur_msg->mbm_data, ch->sw_chan_buf, ch->sw_chan_buf_sz);
+		memcpy(ch->mbc_cur_msg->mbm_data, sm->scm_hdr.data, sm->scm_hdr.sz);
 	}
 
 	/* Done with sw msg. */
-	reset_sw_ch(ch);
-
-	mutex_unlock(&ch->sw_chan_mutex);
-
-	wake_up_interruptible(&ch->sw_chan_wq);
+	free_sw_msg(sm);
 
 	chan_msg_done(ch, 0);
 
 	return true;
 }
 
-static bool do_hw_rx(struct mailbox_channel *ch)
+/*
+ * Check HW channel status for the given condition. In burst mode, we keep
+ * polling for a short while before giving up, since peer is likely in the
+ * middle of pumping / draining the FIFO and will be done very soon.
+ */
+static bool hw_chan_ready(struct mailbox_channel *ch, u32 mask, bool spin)
 {
 	struct mailbox *mbx = ch->mbc_parent;
-	struct mailbox_pkt *pkt = &ch->mbc_packet;
-	u32 type;
-	bool eom = false, read_hw = false;
-	u32 st = mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_status);
-	bool progress = false;
+	ktime_t end = ktime_add_us(ktime_get(), MAILBOX_BURST_SPIN_US);
+	u32 st;
 
-	/* Check if a packet is ready for reading. */
-	if (st & ~STATUS_VALID) {
+	do {
+		st = mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_status);
 		/* Device is still being reset or firewall tripped. */
-		read_hw = false;
-	} else {
-		read_hw = ((st & STATUS_RTA) != 0);
-	}
+		if (st & ~STATUS_VALID)
+			return false;
+		if (st & mask)
+			return true;
+		cpu_relax();
+	} while (spin && ktime_before(ktime_get(), end));
+
+	return false;
+}
 
-	if (!read_hw)
-		return progress;
+/* Check if a packet is ready for reading from HW RX channel. */
+static bool rx_hw_chan_ready(struct mailbox_channel *ch, bool spin)
+{
+	return hw_chan_ready(ch, STATUS_RTA, spin);
+}
+
+static bool do_hw_rx(struct mailbox_channel *ch)
+{
+	struct mailbox *mbx = ch->mbc_parent;
+	struct mailbox_pkt *pkt = &ch->mbc_packet;
+	u32 type, flags;
+	bool eom = false;
+	bool progress = false;
+	size_t sz;
 
 	chan_recv_pkt(ch);
 	type = pkt->hdr.type & PKT_TYPE_MASK;
 	eom = ((pkt->hdr.type & PKT_TYPE_MSG_END) != 0);
 
+	/* Pick up the msg on the stream this pkt belongs to. */
+	if (pkt->hdr.type & PKT_TYPE_STREAM)
+		chan_stream_switch(ch, (pkt->hdr.type & PKT_STREAM_MASK) >> PKT_STREAM_SHIFT);
+	else
+		chan_stream_switch(ch, 0);
+
 	switch (type) {
 	case PKT_TEST:
 		memcpy(&mbx->mbx_tst_pkt, &ch->mbc_packet, sizeof(struct mailbox_pkt));
@@ -978,9 +2513,18 @@ static bool do_hw_rx(struct mailbox_channel *ch)
 				ch->mbc_cur_msg->mbm_req_id);
 			chan_msg_done(ch, -EBADMSG);
 		}
-		/* Prepare outstanding msg. */
-		dequeue_rx_msg(ch, pkt->body.msg_start.msg_flags,
-			       pkt->body.msg_start.msg_req_id, pkt->body.msg_start.msg_size);
+		/* Prepare outstanding msg, compressed one is sized by original payload. */
+		flags = pkt->body.msg_start.msg_flags;
+		sz = pkt->body.msg_start.msg_size;
+		if ((flags & MSG_FLAG_LZ4) && pkt->hdr.payload_size >= MSG_LZ4_HDR_SZ)
+			sz = pkt->body.msg_start.payload[0];
+		dequeue_rx_msg(ch, flags, pkt->body.msg_start.msg_req_id, sz);
+		if (ch->mbc_cur_msg && (flags & MSG_FLAG_LZ4)) {
+			int err = msg_zbuf_alloc(ch->mbc_cur_msg, pkt->body.msg_start.msg_size);
+
+			if (err)
+				chan_msg_done(ch, err);
+		}
 		if (!ch->mbc_cur_msg) {
 			MBX_ERR(mbx, "got unexpected msg start pkt");
 			reset_pkt(pkt);
@@ -1015,11 +2559,21 @@ static bool do_hw_rx(struct mailbox_channel *ch)
 static bool chan_do_rx(struct mailbox_channel *ch)
 {
 	struct mailbox *mbx = ch->mbc_parent;
+	int budget = mbx->mbx_burst ? MAILBOX_BURST_PKTS : 1;
 	bool progress = false;
 
 	progress = do_sw_rx(ch);
-	if (!MBX_SW_ONLY(mbx))
+	if (MBX_SW_ONLY(mbx))
+		return progress;
+
+	/* Keep pulling pkts for as long as HW has them, up to the budget. */
+	while (budget-- > 0) {
+		bool spin = mbx->mbx_burst && chan_busy(ch);
+
+		if (!rx_hw_chan_ready(ch, spin))
+			break;
 		progress |= do_hw_rx(ch);
+	}
 
 	return progress;
 }
@@ -1039,51 +2593,73 @@ static void chan_msg2pkt(struct mailbox_channel *ch)
 	else
 		payload_off = offsetof(struct mailbox_pkt, body.msg_body.payload);
 	cnt = PACKET_SIZE * sizeof(u32) - payload_off;
-	if (cnt >= msg->mbm_len - ch->mbc_bytes_done) {
-		cnt = msg->mbm_len - ch->mbc_bytes_done;
+	if (cnt >= msg_wire_len(msg) - ch->mbc_bytes_done) {
+		cnt = msg_wire_len(msg) - ch->mbc_bytes_done;
 		is_eom = true;
 	}
 
 	pkt->hdr.type = is_start ? PKT_MSG_START : PKT_MSG_BODY;
 	pkt->hdr.type |= is_eom ? PKT_TYPE_MSG_END : 0;
+	if (ch->mbc_parent->mbx_pkt_stream || ch->mbc_stream)
+		pkt->hdr.type |= PKT_TYPE_STREAM | (ch->mbc_stream << PKT_STREAM_SHIFT);
 	pkt->hdr.payload_size = cnt;
 
 	if (is_start) {
 		pkt->body.msg_start.msg_req_id = msg->mbm_req_id;
-		pkt->body.msg_start.msg_size = msg->mbm_len;
+		pkt->body.msg_start.msg_size = msg_wire_len(msg);
 		pkt->body.msg_start.msg_flags = msg->mbm_flags;
 		pkt_data = pkt->body.msg_start.payload;
 	} else {
 		pkt_data = pkt->body.msg_body.payload;
 	}
-	msg_data = msg->mbm_data + ch->mbc_bytes_done;
+	msg_data = msg_wire_data(msg) + ch->mbc_bytes_done;
 	memcpy(pkt_data, msg_data, cnt);
 }
 
-static void do_sw_tx(struct mailbox_channel *ch)
+static bool do_sw_tx(struct mailbox_channel *ch)
 {
+	struct sw_chan_msg *sm;
+
 	mutex_lock(&ch->sw_chan_mutex);
 
 	WARN_ON(!ch->mbc_cur_msg || !ch->mbc_cur_msg->mbm_chan_sw);
-	WARN_ON(ch->sw_chan_msg_id != 0);
 
-	ch->sw_chan_buf = vmalloc(ch->mbc_cur_msg->mbm_len);
-	if (!ch->sw_chan_buf) {
+	/* Msg fits in one slot goes through the shared ring, no extra copy. */
+	if (sw_ring_fits(ch, ch->mbc_cur_msg->mbm_len)) {
+		struct xcl_sw_chan *slot = sw_ring_slot(ch);
+
+		WARN_ON(sw_ring_used(ch) >= XCL_SW_CHAN_RING_NUM_SLOTS);
+		slot->id = ch->mbc_cur_msg->mbm_req_id;
+		slot->flags = ch->mbc_cur_msg->mbm_flags;
+		slot->sz = ch->mbc_cur_msg->mbm_len;
+		memcpy(slot->data, ch->mbc_cur_msg->mbm_data, slot->sz);
+		ch->mbc_bytes_done = ch->mbc_cur_msg->mbm_len;
+
+		/* Publish the slot to daemon. */
+		ch->sw_chan_ring_idx++;
+		/* Make sure slot content is written before daemon sees it. */
+		smp_store_release(&ch->sw_chan_ring->head, ch->sw_chan_ring_idx);
+
 		mutex_unlock(&ch->sw_chan_mutex);
-		return;
+		wake_up_interruptible(&ch->sw_chan_wq);
+		return true;
 	}
 
-	ch->sw_chan_buf_sz = ch->mbc_cur_msg->mbm_len;
-	ch->sw_chan_msg_id = ch->mbc_cur_msg->mbm_req_id;
-	ch->sw_chan_msg_flags = ch->mbc_cur_msg->mbm_flags;
-	memcpy(ch->sw_chan_buf, ch->mbc_cur_msg->mbm_data, ch->sw_chan_buf_sz);
+	sm = alloc_sw_msg(ch->mbc_cur_msg->mbm_req_id, ch->mbc_cur_msg->mbm_flags,
+			  ch->mbc_cur_msg->mbm_len);
+	if (!sm) {
+		mutex_unlock(&ch->sw_chan_mutex);
+		return false;
+	}
+	memcpy(sm->scm_hdr.data, ch->mbc_cur_msg->mbm_data, sm->scm_hdr.sz);
 	ch->mbc_bytes_done = ch->mbc_cur_msg->mbm_len;
 
 	/* Notify sw tx channel handler. */
-	atomic_inc(&ch->sw_num_pending_msg);
+	sw_chan_msg_enqueue(ch, sm);
 
 	mutex_unlock(&ch->sw_chan_mutex);
 	wake_up_interruptible(&ch->sw_chan_wq);
+	return true;
 }
 
 static void do_hw_tx(struct mailbox_channel *ch)
@@ -1103,26 +2679,60 @@ static void dequeue_tx_msg(struct mailbox_channel *ch)
 	if (ch->mbc_cur_msg) {
 		ch->mbc_cur_msg->mbm_start_ts = ktime_get_ns();
 		ch->mbc_cur_msg->mbm_num_pkts = 0;
+		MBX_TRACE_MSG(dequeue, ch, ch->mbc_cur_msg);
+		outstanding_msg_timer_reset(ch);
 	}
 }
 
-/* Check if HW TX channel is ready for next msg. */
-static bool tx_hw_chan_ready(struct mailbox_channel *ch)
+/*
+ * Pick the stream to send next pkt on. Parked msg is resumed once current one
+ * is done. Big msg being sent is parked if there is a small one waiting and
+ * peer can take interleaved msgs.
+ */
+static void chan_tx_stream_sched(struct mailbox_channel *ch)
 {
-	struct mailbox *mbx = ch->mbc_parent;
-	u32 st;
+	struct mailbox_msg *msg = ch->mbc_cur_msg;
+	bool hi_waiting;
+	int sid;
+
+	if (!msg) {
+		sid = chan_stream_find(ch, MBX_TX_STREAMS, true);
+		if (sid >= 0)
+			chan_stream_switch(ch, sid);
+		return;
+	}
+
+	if (!ch->mbc_parent->mbx_pkt_stream || msg->mbm_chan_sw ||
+	    msg->mbm_prio != MSG_PRIO_NORMAL)
+		return;
 
-	st = mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_status);
-	return ((st != 0xffffffff) && ((st & STATUS_STA) != 0));
+	mutex_lock(&ch->mbc_mutex);
+	hi_waiting = !list_empty(&ch->mbc_msgs[MSG_PRIO_HIGH]);
+	mutex_unlock(&ch->mbc_mutex);
+	if (!hi_waiting)
+		return;
+
+	sid = chan_stream_find(ch, MBX_TX_STREAMS, false);
+	if (sid >= 0)
+		chan_stream_switch(ch, sid);
+}
+
+/* Check if HW TX channel is ready for next msg. */
+static bool tx_hw_chan_ready(struct mailbox_channel *ch, bool spin)
+{
+	return hw_chan_ready(ch, STATUS_STA, spin);
 }
 
-/* Check if SW TX channel is ready for next msg. */
-static bool tx_sw_chan_ready(struct mailbox_channel *ch)
+/* Check if SW TX channel has room for sending out the msg. */
+static bool tx_sw_chan_room(struct mailbox_channel *ch, struct mailbox_msg *msg)
 {
 	bool ready;
 
 	mutex_lock(&ch->sw_chan_mutex);
-	ready = (ch->sw_chan_msg_id == 0);
+	if (sw_ring_fits(ch, msg->mbm_len))
+		ready = (sw_ring_used(ch) < XCL_SW_CHAN_RING_NUM_SLOTS);
+	else
+		ready = (atomic_read(&ch->sw_num_pending_msg) < MAX_SW_MSG_QUEUE_LEN);
 	mutex_unlock(&ch->sw_chan_mutex);
 	return ready;
 }
@@ -1132,42 +2742,142 @@ static bool tx_sw_chan_ready(struct mailbox_channel *ch)
  */
 static bool chan_do_tx(struct mailbox_channel *ch)
 {
-	struct mailbox_msg *curmsg = ch->mbc_cur_msg;
+	struct mailbox *mbx = ch->mbc_parent;
+	int budget = mbx->mbx_burst ? MAILBOX_BURST_PKTS : 1;
+	struct mailbox_msg *curmsg;
 	bool progress = false;
+	bool hw_ready;
+
+	while (budget-- > 0) {
+		curmsg = ch->mbc_cur_msg;
+		hw_ready = false;
+
+		/* Check if current outstanding msg is fully sent. */
+		if (curmsg) {
+			bool done;
+
+			if (curmsg->mbm_chan_sw) {
+				/* Sw msg is sent once it's queued up for daemon. */
+				done = (curmsg->mbm_len == ch->mbc_bytes_done) ||
+					tx_sw_chan_room(ch, curmsg);
+			} else {
+				/* Wait for peer to drain the FIFO if we're pumping. */
+				hw_ready = tx_hw_chan_ready(ch, mbx->mbx_burst && progress);
+				done = hw_ready;
+			}
+			if (!done)
+				break;
 
-	/* Check if current outstanding msg is fully sent. */
-	if (curmsg) {
-		bool done = curmsg->mbm_chan_sw ? tx_sw_chan_ready(ch) : tx_hw_chan_ready(ch);
-
-		if (done) {
 			curmsg->mbm_num_pkts++;
-			if (curmsg->mbm_len == ch->mbc_bytes_done)
+			if (msg_wire_len(curmsg) == ch->mbc_bytes_done)
 				chan_msg_done(ch, 0);
 			progress = true;
 		}
-	}
 
-	dequeue_tx_msg(ch);
-	curmsg = ch->mbc_cur_msg;
+		chan_tx_stream_sched(ch);
+		dequeue_tx_msg(ch);
+		curmsg = ch->mbc_cur_msg;
+		if (!curmsg)
+			break;
 
-	/* Send the next msg out. */
-	if (curmsg) {
+		/* Send the next msg out, HW status is read only once per pkt. */
 		if (curmsg->mbm_chan_sw) {
-			if (tx_sw_chan_ready(ch)) {
-				do_sw_tx(ch);
-				progress = true;
-			}
+			if (!tx_sw_chan_room(ch, curmsg) || !do_sw_tx(ch))
+				break;
 		} else {
-			if (tx_hw_chan_ready(ch)) {
-				do_hw_tx(ch);
-				progress = true;
-			}
+			if (!hw_ready && !tx_hw_chan_ready(ch, false))
+				break;
+			do_hw_tx(ch);
 		}
+		progress = true;
 	}
 
 	return progress;
 }
 
+/*
+ * PEER_DATA request in flight or recently done, shared by all callers sending
+ * the same one. Freed by the last user, the list counts as one.
+ */
+struct mailbox_coalesce {
+	struct list_head	mco_list;
+	void			*mco_req;
+	size_t			mco_reqlen;
+	void			*mco_resp;
+	size_t			mco_bufsz;
+	size_t			mco_resplen;
+	bool			mco_sw_ch;
+	bool			mco_done;
+	int			mco_err;
+	u64			mco_done_ts;
+	u32			mco_users;
+	struct completion	mco_comp;
+};
+
+/* mbx_coalesce_lock must be held. */
+static void mailbox_coalesce_put(struct mailbox_coalesce *c)
+{
+	if (--c->mco_users)
+		return;
+
+	kvfree(c->mco_req);
+	kvfree(c->mco_resp);
+	kfree(c);
+}
+
+/* Drop responses which are no longer fresh, mbx_coalesce_lock must be held. */
+static void mailbox_coalesce_expire(struct mailbox *mbx, bool all)
+{
+	u64 now = ktime_get_ns();
+	struct mailbox_coalesce *c, *next;
+
+	list_for_each_entry_safe(c, next, &mbx->mbx_coalesce, mco_list) {
+		if (!c->mco_done)
+			continue;
+		if (!all && now - c->mco_done_ts < (u64)mbx->mbx_coalesce_ms * NSEC_PER_MSEC)
+			continue;
+		list_del(&c->mco_list);
+		mailbox_coalesce_put(c);
+	}
+}
+
+static struct mailbox_coalesce *mailbox_coalesce_find(struct mailbox *mbx, void *req,
+						      size_t reqlen, size_t resplen, bool sw_ch)
+{
+	struct mailbox_coalesce *c;
+
+	list_for_each_entry(c, &mbx->mbx_coalesce, mco_list) {
+		if (c->mco_sw_ch == sw_ch && c->mco_reqlen == reqlen &&
+		    c->mco_bufsz == resplen && !memcmp(c->mco_req, req, reqlen))
+			return c;
+	}
+	return NULL;
+}
+
+static struct mailbox_coalesce *mailbox_coalesce_alloc(void *req, size_t reqlen,
+						       size_t resplen, bool sw_ch)
+{
+	struct mailbox_coalesce *c = kzalloc(sizeof(*c), GFP_KERNEL);
+
+	if (!c)
+		return NULL;
+
+	c->mco_req = kvmalloc(reqlen, GFP_KERNEL);
+	c->mco_resp = kvmalloc(resplen, GFP_KERNEL);
+	if (!c->mco_req || !c->mco_resp) {
+		kvfree(c->mco_req);
+		kvfree(c->mco_resp);
+		kfree(c);
+		return NULL;
+	}
+	memcpy(c->mco_req, req, reqlen);
+	c->mco_reqlen = reqlen;
+	c->mco_bufsz = resplen;
+	c->mco_sw_ch = sw_ch;
+	init_completion(&c->mco_comp);
+	return c;
+}
+
 static ssize_t mailbox_ctl_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct platform_device *pdev = to_platform_device(dev);
@@ -1261,23 +2971,315 @@ static ssize_t mailbox_pkt_store(struct device *dev,
 		return 0;
 	}
 
-	memcpy(pkt->body.data, buf, count);
-	pkt->hdr.payload_size = count;
-	pkt->hdr.type = PKT_TEST;
-
-	/* Sending test pkt. */
-	memcpy(&mbx->mbx_tx.mbc_packet, &mbx->mbx_tst_pkt, sizeof(struct mailbox_pkt));
-	reset_pkt(&mbx->mbx_tst_pkt);
-	chan_send_pkt(&mbx->mbx_tx);
-	return count;
+	memcpy(pkt->body.data, buf, count);
+	pkt->hdr.payload_size = count;
+	pkt->hdr.type = PKT_TEST;
+
+	/* Sending test pkt. */
+	memcpy(&mbx->mbx_tx.mbc_packet, &mbx->mbx_tst_pkt, sizeof(struct mailbox_pkt));
+	reset_pkt(&mbx->mbx_tst_pkt);
+	chan_send_pkt(&mbx->mbx_tx);
+	return count;
+}
+
+/* Packet test i/f. */
+static DEVICE_ATTR_RW(mailbox_pkt);
+
+static ssize_t mailbox_burst_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%d\n", mbx->mbx_burst);
+}
+
+static ssize_t mailbox_burst_store(struct device *dev,
+				   struct device_attribute *da, const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	bool burst;
+
+	if (kstrtobool(buf, &burst))
+		return -EINVAL;
+
+	mbx->mbx_burst = burst;
+	return count;
+}
+
+/* Burst mode on/off switch. */
+static DEVICE_ATTR_RW(mailbox_burst);
+
+static ssize_t mailbox_poll_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%u %u %u\n", mbx->mbx_poll_spin_us,
+		       mbx->mbx_poll_min_us, mbx->mbx_poll_max_us);
+}
+
+static ssize_t mailbox_poll_store(struct device *dev,
+				  struct device_attribute *da, const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	u32 spin, lo, hi;
+
+	if (sscanf(buf, "%u %u %u", &spin, &lo, &hi) != 3 || lo > hi) {
+		MBX_ERR(mbx, "input should be <spin_us min_us max_us>");
+		return -EINVAL;
+	}
+
+	mbx->mbx_poll_spin_us = spin;
+	mbx->mbx_poll_min_us = lo;
+	mbx->mbx_poll_max_us = hi;
+	return count;
+}
+
+/* Adaptive polling parameters, only used when intr is not available. */
+static DEVICE_ATTR_RW(mailbox_poll);
+
+static ssize_t mailbox_req_queue_len_show(struct device *dev,
+					  struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%u\n", mbx->mbx_req_max);
+}
+
+static ssize_t mailbox_req_queue_len_store(struct device *dev, struct device_attribute *da,
+					   const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	u32 len;
+
+	if (kstrtou32(buf, 0, &len) || len == 0 || len > MAX_MSG_QUEUE_LEN_LIMIT) {
+		MBX_ERR(mbx, "input should be in [1, %d]", MAX_MSG_QUEUE_LEN_LIMIT);
+		return -EINVAL;
+	}
+
+	mbx->mbx_req_max = len;
+	return count;
+}
+
+/* Max number of pending requests from peer. */
+static DEVICE_ATTR_RW(mailbox_req_queue_len);
+
+static ssize_t mailbox_compress_min_show(struct device *dev,
+					 struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%u\n", mbx->mbx_compress_min);
+}
+
+static ssize_t mailbox_compress_min_store(struct device *dev, struct device_attribute *da,
+					  const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	u32 len;
+
+	if (kstrtou32(buf, 0, &len)) {
+		MBX_ERR(mbx, "input should be number of bytes, 0 to disable");
+		return -EINVAL;
+	}
+
+	mbx->mbx_compress_min = len;
+	return count;
+}
+
+/* Min payload size of TX msg to be compressed, if peer agrees. */
+static DEVICE_ATTR_RW(mailbox_compress_min);
+
+static ssize_t mailbox_stripe_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%u %u\n", mbx->mbx_stripe_min, mbx->mbx_stripe_sw_pct);
+}
+
+static ssize_t mailbox_stripe_store(struct device *dev, struct device_attribute *da,
+				    const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	u32 len, pct;
+
+	if (sscanf(buf, "%u %u", &len, &pct) != 2 || pct == 0 || pct >= 100) {
+		MBX_ERR(mbx, "input should be <min_bytes sw_percent>, min_bytes 0 to disable");
+		return -EINVAL;
+	}
+
+	mbx->mbx_stripe_min = len;
+	mbx->mbx_stripe_sw_pct = pct;
+	return count;
+}
+
+/*
+ * Min payload size of TX msg to be striped across HW and SW channels, if peer
+ * agrees, and share of SW channel in percent.
+ */
+static DEVICE_ATTR_RW(mailbox_stripe);
+
+static ssize_t mailbox_coalesce_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%u %u\n", mbx->mbx_coalesce_on, mbx->mbx_coalesce_ms);
+}
+
+static ssize_t mailbox_coalesce_store(struct device *dev, struct device_attribute *da,
+				      const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	u32 on, ms;
+
+	if (sscanf(buf, "%u %u", &on, &ms) != 2 || on > 1) {
+		MBX_ERR(mbx, "input should be <0|1 fresh_ms>");
+		return -EINVAL;
+	}
+
+	mutex_lock(&mbx->mbx_coalesce_lock);
+	mbx->mbx_coalesce_on = on;
+	mbx->mbx_coalesce_ms = ms;
+	mailbox_coalesce_expire(mbx, !on || !ms);
+	mutex_unlock(&mbx->mbx_coalesce_lock);
+	return count;
+}
+
+/*
+ * Whether identical PEER_DATA requests in flight share one round trip and for
+ * how long a response is reused after it's received, 0 for not at all.
+ */
+static DEVICE_ATTR_RW(mailbox_coalesce);
+
+static ssize_t mailbox_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	struct mailbox_channel *chs[] = { &mbx->mbx_tx, &mbx->mbx_rx };
+	static const char * const names[] = { "tx", "rx" };
+	struct mailbox_chan_stats *st;
+	u64 msgs, bytes, pkts, errors, timeouts, drops, peer_dead;
+	u64 stripe_msgs, stripe_bytes, stripe_ns;
+	unsigned long flags;
+	ssize_t cnt = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chs); i++) {
+		const char *name = names[i];
+
+		st = &chs[i]->mbc_stats;
+		spin_lock_irqsave(&chs[i]->mbc_stats_lock, flags);
+		msgs = st->mcs_msgs;
+		bytes = st->mcs_bytes;
+		pkts = st->mcs_pkts;
+		errors = st->mcs_errors;
+		timeouts = st->mcs_timeouts;
+		drops = st->mcs_drops;
+		peer_dead = st->mcs_peer_dead;
+		stripe_msgs = st->mcs_stripe_msgs;
+		stripe_bytes = st->mcs_stripe_bytes;
+		stripe_ns = st->mcs_stripe_ns;
+		spin_unlock_irqrestore(&chs[i]->mbc_stats_lock, flags);
+
+		cnt += scnprintf(buf + cnt, PAGE_SIZE - cnt,
+				 "%s_msgs %llu\n%s_bytes %llu\n%s_pkts %llu\n"
+				 "%s_errors %llu\n%s_timeouts %llu\n%s_drops %llu\n"
+				 "%s_peer_dead %llu\n%s_queued %u\n",
+				 name, msgs, name, bytes, name, pkts,
+				 name, errors, name, timeouts, name, drops,
+				 name, peer_dead, name, READ_ONCE(chs[i]->mbc_queued));
+		/* Effective bandwidth of striped msgs in MB/s. */
+		cnt += scnprintf(buf + cnt, PAGE_SIZE - cnt,
+				 "%s_stripe_msgs %llu\n%s_stripe_bytes %llu\n%s_stripe_mbps %llu\n",
+				 name, stripe_msgs, name, stripe_bytes, name,
+				 stripe_ns ? div64_u64(stripe_bytes * 1000, stripe_ns) : 0);
+	}
+	cnt += scnprintf(buf + cnt, PAGE_SIZE - cnt, "req_coalesced %llu\n",
+			 READ_ONCE(mbx->mbx_coalesced));
+
+	return cnt;
+}
+
+/* Per channel counters, one "<chan>_<counter> <value>" per line. */
+static DEVICE_ATTR_RO(mailbox_stats);
+
+static ssize_t mailbox_latency_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	struct mailbox_channel *chs[] = { &mbx->mbx_tx, &mbx->mbx_rx };
+	static const char * const names[] = { "tx", "rx" };
+	static const char trunc[] = "...\n";
+	/* Always leave room for the truncation marker. */
+	const ssize_t limit = PAGE_SIZE - sizeof(trunc);
+	u64 hist[MBX_LAT_BUCKETS];
+	unsigned long flags;
+	ssize_t cnt = 0, start;
+	int i, op, stage, b;
+
+	for (i = 0; i < ARRAY_SIZE(chs); i++) {
+		for (op = 0; op < MBX_LAT_OPCODES; op++) {
+			for (stage = 0; stage < MBX_LAT_NUM; stage++) {
+				u64 total = 0;
+
+				spin_lock_irqsave(&chs[i]->mbc_stats_lock, flags);
+				memcpy(hist, chs[i]->mbc_stats.mcs_lat[op][stage], sizeof(hist));
+				spin_unlock_irqrestore(&chs[i]->mbc_stats_lock, flags);
+
+				for (b = 0; b < MBX_LAT_BUCKETS; b++)
+					total += hist[b];
+				if (!total)
+					continue;
+
+				start = cnt;
+				cnt += scnprintf(buf + cnt, limit - cnt, "%s %d %s",
+						 names[i], op, mailbox_lat_stage_name[stage]);
+				for (b = 0; b < MBX_LAT_BUCKETS; b++)
+					cnt += scnprintf(buf + cnt, limit - cnt, " %llu",
+							 hist[b]);
+				cnt += scnprintf(buf + cnt, limit - cnt, "\n");
+				/* Never hand out a partial line. */
+				if (cnt >= limit - 1) {
+					cnt = start;
+					cnt += scnprintf(buf + cnt, PAGE_SIZE - cnt, "%s", trunc);
+					return cnt;
+				}
+			}
+		}
+	}
+
+	return cnt;
 }
 
-/* Packet test i/f. */
-static DEVICE_ATTR_RW(mailbox_pkt);
+/*
+ * Per opcode latency histograms, one "<chan> <opcode> <stage> <bucket0> ..."
+ * per line. Only opcodes with samples are shown. If it does not fit in one
+ * page, output stops at the last complete line followed by a "..." line.
+ * Opcode 0 is for msgs which carry no opcode, e.g. responses sent to peer.
+ */
+static DEVICE_ATTR_RO(mailbox_latency);
 
 static struct attribute *mailbox_attrs[] = {
 	&dev_attr_mailbox_ctl.attr,
 	&dev_attr_mailbox_pkt.attr,
+	&dev_attr_mailbox_burst.attr,
+	&dev_attr_mailbox_poll.attr,
+	&dev_attr_mailbox_req_queue_len.attr,
+	&dev_attr_mailbox_compress_min.attr,
+	&dev_attr_mailbox_stripe.attr,
+	&dev_attr_mailbox_coalesce.attr,
+	&dev_attr_mailbox_stats.attr,
+	&dev_attr_mailbox_latency.attr,
 	NULL,
 };
 
@@ -1289,7 +3291,8 @@ static const struct attribute_group mailbox_attrgroup = {
  * Msg will be sent to peer and reply will be received.
  */
 static int mailbox_request(struct platform_device *pdev, void *req,
-			   size_t reqlen, void *resp, size_t *resplen, bool sw_ch, u32 resp_ttl)
+			   size_t reqlen, void *resp, size_t *resplen, bool sw_ch,
+			   u32 resp_timeout_ms)
 {
 	int rv = -ENOMEM;
 	struct mailbox *mbx = platform_get_drvdata(pdev);
@@ -1311,6 +3314,7 @@ static int mailbox_request(struct platform_device *pdev, void *req,
 		goto fail;
 	/* Only interested in response w/ same ID. */
 	respmsg->mbm_req_id = reqmsg->mbm_req_id;
+	respmsg->mbm_opcode = msg_opcode(reqmsg);
 	respmsg->mbm_chan_sw = sw_ch;
 
 	/* Always enqueue RX msg before TX one to avoid race. */
@@ -1333,7 +3337,7 @@ static int mailbox_request(struct platform_device *pdev, void *req,
 	free_msg(reqmsg);
 
 	/* Start timer and wait for resp to be received. */
-	msg_timer_on(respmsg, resp_ttl);
+	msg_timer_on(respmsg, resp_timeout_ms);
 	wait_for_completion(&respmsg->mbm_complete);
 	rv = respmsg->mbm_error;
 	if (rv == 0)
@@ -1350,6 +3354,189 @@ fail:
 	return rv;
 }
 
+/*
+ * Same as mailbox_request(), but identical PEER_DATA requests share one round
+ * trip. The first caller sends it out, the others wait for its response.
+ */
+static int mailbox_request_coalesced(struct platform_device *pdev, void *req,
+				     size_t reqlen, void *resp, size_t *resplen, bool sw_ch,
+				     u32 resp_timeout_ms)
+{
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	struct xcl_mailbox_req *mreq = req;
+	struct mailbox_coalesce *c;
+	bool leader = false;
+	int rv;
+
+	if (!mbx->mbx_coalesce_on || reqlen < offsetofend(struct xcl_mailbox_req, req) ||
+	    mreq->req != XCL_MAILBOX_REQ_PEER_DATA)
+		goto alone;
+
+	mutex_lock(&mbx->mbx_coalesce_lock);
+	mailbox_coalesce_expire(mbx, false);
+	c = mailbox_coalesce_find(mbx, req, reqlen, *resplen, sw_ch);
+	if (c) {
+		c->mco_users++;
+		mbx->mbx_coalesced++;
+	} else {
+		c = mailbox_coalesce_alloc(req, reqlen, *resplen, sw_ch);
+		if (c) {
+			c->mco_users = 2;
+			list_add_tail(&c->mco_list, &mbx->mbx_coalesce);
+			leader = true;
+		}
+	}
+	mutex_unlock(&mbx->mbx_coalesce_lock);
+	if (!c)
+		goto alone;
+
+	if (leader) {
+		size_t len = c->mco_bufsz;
+
+		rv = mailbox_request(pdev, req, reqlen, c->mco_resp, &len, sw_ch, resp_timeout_ms);
+
+		mutex_lock(&mbx->mbx_coalesce_lock);
+		c->mco_err = rv;
+		c->mco_resplen = len;
+		c->mco_done = true;
+		c->mco_done_ts = ktime_get_ns();
+		/* Only good response is kept around for later callers. */
+		if (rv || !mbx->mbx_coalesce_ms) {
+			list_del(&c->mco_list);
+			mailbox_coalesce_put(c);
+		}
+		mutex_unlock(&mbx->mbx_coalesce_lock);
+		complete_all(&c->mco_comp);
+	} else {
+		wait_for_completion(&c->mco_comp);
+	}
+
+	rv = c->mco_err;
+	if (!rv) {
+		memcpy(resp, c->mco_resp, c->mco_resplen);
+		*resplen = c->mco_resplen;
+	}
+
+	mutex_lock(&mbx->mbx_coalesce_lock);
+	mailbox_coalesce_put(c);
+	mutex_unlock(&mbx->mbx_coalesce_lock);
+	return rv;
+
+alone:
+	return mailbox_request(pdev, req, reqlen, resp, resplen, sw_ch, resp_timeout_ms);
+}
+
+/*
+ * Request of an async one is done. Start counting down for its response, or
+ * fail the response right away on error.
+ */
+static void mailbox_async_req_sent(void *arg, void *data, size_t len,
+				   u64 msgid, int err, bool sw_ch)
+{
+	struct mailbox *mbx = arg;
+	struct mailbox_channel *ch = &mbx->mbx_rx;
+	struct mailbox_msg *respmsg;
+
+	if (err) {
+		/* Not found if it's already being received, leave it to the channel. */
+		respmsg = chan_msg_dequeue(ch, msgid);
+		if (respmsg)
+			msg_done(respmsg, err);
+		return;
+	}
+
+	mutex_lock(&ch->mbc_mutex);
+	respmsg = __chan_msg_find(ch, msgid);
+	if (respmsg)
+		__msg_timer_on(ch, respmsg, respmsg->mbm_timeout_ms);
+	mutex_unlock(&ch->mbc_mutex);
+}
+
+/*
+ * Msg will be sent to peer and reply will be passed to caller's callback.
+ * Caller can keep as many as it wants in flight.
+ */
+static int mailbox_request_async(struct platform_device *pdev,
+				 struct xrt_mailbox_request_async *req)
+{
+	int rv = -ENOMEM;
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+	struct mailbox_msg *reqmsg = NULL, *respmsg = NULL;
+
+	if (!req->xmira_cb)
+		return -EINVAL;
+
+	/* If peer is not alive, no point sending req and waiting for resp. */
+	if (mbx->mbx_peer_dead)
+		return -ENOTCONN;
+
+	reqmsg = alloc_msg(NULL, req->xmira_req_size);
+	if (!reqmsg)
+		goto fail;
+	memcpy(reqmsg->mbm_data, req->xmira_req, req->xmira_req_size);
+
+	respmsg = alloc_msg(req->xmira_resp, req->xmira_resp_size);
+	if (!respmsg)
+		goto fail;
+
+	/*
+	 * Request is freed once it's sent and response may be freed on time out
+	 * while a late reply is still on its way, use an ID that's never reused.
+	 */
+	reqmsg->mbm_chan_sw = req->xmira_sw_ch;
+	reqmsg->mbm_req_id = atomic64_inc_return(&mbx->mbx_req_id);
+	reqmsg->mbm_flags |= MSG_FLAG_REQUEST;
+	reqmsg->mbm_cb = mailbox_async_req_sent;
+	reqmsg->mbm_cb_arg = mbx;
+
+	respmsg->mbm_req_id = reqmsg->mbm_req_id;
+	respmsg->mbm_chan_sw = req->xmira_sw_ch;
+	respmsg->mbm_opcode = msg_opcode(reqmsg);
+	respmsg->mbm_cb = req->xmira_cb;
+	respmsg->mbm_cb_arg = req->xmira_cb_arg;
+	/* Timer is started by mailbox_async_req_sent(), not while req is queued. */
+	respmsg->mbm_timeout_ms = req->xmira_resp_timeout_ms;
+	req->xmira_req_id = respmsg->mbm_req_id;
+
+	/* Always enqueue RX msg before TX one to avoid race. */
+	rv = chan_msg_enqueue(&mbx->mbx_rx, respmsg);
+	if (rv)
+		goto fail;
+	rv = chan_msg_enqueue(&mbx->mbx_tx, reqmsg);
+	if (rv) {
+		/* Req is not sent, resp is only gone if RX has been shut down. */
+		respmsg = chan_msg_dequeue(&mbx->mbx_rx, req->xmira_req_id);
+		/* Failed by RX already, caller has been notified through cb. */
+		if (!respmsg)
+			rv = 0;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (reqmsg)
+		free_msg(reqmsg);
+	if (respmsg)
+		free_msg(respmsg);
+	return rv;
+}
+
+/*
+ * Refuse request from peer w/o waiting for it to go out, for listener which is
+ * too busy to take it. Request is dropped if peer does not take MSG_FLAG_BUSY.
+ */
+static int mailbox_refuse(struct platform_device *pdev, u64 reqid, bool sw_ch)
+{
+	struct mailbox *mbx = platform_get_drvdata(pdev);
+
+	chan_stats_inc(&mbx->mbx_rx, &mbx->mbx_rx.mbc_stats.mcs_drops);
+	if (!mbx->mbx_busy_nack)
+		return -EOPNOTSUPP;
+	mailbox_busy_nack(mbx, reqid, sw_ch);
+	return 0;
+}
+
 /*
  * Posting notification or response to peer.
  */
@@ -1394,58 +3581,50 @@ static void process_request(struct mailbox *mbx, struct mailbox_msg *msg)
 				   msg->mbm_len, msg->mbm_req_id, msg->mbm_error, msg->mbm_chan_sw);
 	} else {
 		MBX_INFO(mbx, "msg dropped, no listener");
+		chan_stats_inc(&mbx->mbx_rx, &mbx->mbx_rx.mbc_stats.mcs_drops);
 	}
 
 	mutex_unlock(&mbx->mbx_listen_cb_lock);
 }
 
 /*
- * Wait for request from peer.
+ * Process requests from peer queued up by RX channel. Runs on the shared
+ * workqueue, which never runs one work on two CPUs, so reqs are still processed
+ * one by one in the order they are received.
  */
 static void mailbox_recv_request(struct work_struct *work)
 {
 	struct mailbox_msg *msg = NULL;
 	struct mailbox *mbx = container_of(work, struct mailbox, mbx_listen_worker);
 
-	while (!mbx->mbx_listen_stop) {
-		/* Only interested in request msg. */
-		wait_for_completion_interruptible(&mbx->mbx_comp);
-
-		mutex_lock(&mbx->mbx_lock);
-
-		while ((msg = list_first_entry_or_null(&mbx->mbx_req_list,
-						       struct mailbox_msg, mbm_list))) {
-			list_del(&msg->mbm_list);
-			mbx->mbx_req_cnt--;
-			mutex_unlock(&mbx->mbx_lock);
-
-			/* Process msg without holding mutex. */
-			process_request(mbx, msg);
-			free_msg(msg);
-
-			mutex_lock(&mbx->mbx_lock);
-		}
+	mutex_lock(&mbx->mbx_lock);
 
+	while (!READ_ONCE(mbx->mbx_listen_stop) &&
+	       (msg = list_first_entry_or_null(&mbx->mbx_req_list, struct mailbox_msg, mbm_list))) {
+		list_del(&msg->mbm_list);
+		mbx->mbx_req_cnt--;
 		mutex_unlock(&mbx->mbx_lock);
-	}
 
-	/* Drain all msg before quit. */
-	mutex_lock(&mbx->mbx_lock);
-	while ((msg = list_first_entry_or_null(&mbx->mbx_req_list, struct mailbox_msg, mbm_list))) {
-		list_del(&msg->mbm_list);
+		/* Process msg without holding mutex. */
+		process_request(mbx, msg);
 		free_msg(msg);
+
+		mutex_lock(&mbx->mbx_lock);
 	}
+
 	mutex_unlock(&mbx->mbx_lock);
 }
 
-static int mailbox_listen(struct platform_device *pdev, mailbox_msg_cb_t cb, void *cbarg)
+static int mailbox_listen(struct platform_device *pdev, struct xrt_mailbox_listen *listen)
 {
 	struct mailbox *mbx = platform_get_drvdata(pdev);
 
 	mutex_lock(&mbx->mbx_listen_cb_lock);
 
-	mbx->mbx_listen_cb_arg = cbarg;
-	mbx->mbx_listen_cb = cb;
+	listen->xmil_prev_cb = mbx->mbx_listen_cb;
+	listen->xmil_prev_cb_arg = mbx->mbx_listen_cb_arg;
+	mbx->mbx_listen_cb_arg = listen->xmil_cb_arg;
+	mbx->mbx_listen_cb = listen->xmil_cb;
 
 	mutex_unlock(&mbx->mbx_listen_cb_lock);
 
@@ -1468,20 +3647,38 @@ static int mailbox_leaf_call(struct platform_device *pdev, u32 cmd, void *arg)
 				   post->xmip_data_size, post->xmip_sw_ch);
 		break;
 	}
+	case XRT_MAILBOX_REFUSE: {
+		struct xrt_mailbox_post *post = (struct xrt_mailbox_post *)arg;
+
+		ret = mailbox_refuse(pdev, post->xmip_req_id, post->xmip_sw_ch);
+		break;
+	}
 	case XRT_MAILBOX_REQUEST: {
 		struct xrt_mailbox_request *req = (struct xrt_mailbox_request *)arg;
 
-		ret = mailbox_request(pdev, req->xmir_req, req->xmir_req_size,
-				      req->xmir_resp, &req->xmir_resp_size, req->xmir_sw_ch,
-				      req->xmir_resp_ttl);
+		ret = mailbox_request_coalesced(pdev, req->xmir_req, req->xmir_req_size,
+						req->xmir_resp, &req->xmir_resp_size,
+						req->xmir_sw_ch, req->xmir_resp_timeout_ms);
 		break;
 	}
-	case XRT_MAILBOX_LISTEN: {
-		struct xrt_mailbox_listen *listen = (struct xrt_mailbox_listen *)arg;
-
-		ret = mailbox_listen(pdev, listen->xmil_cb, listen->xmil_cb_arg);
+	case XRT_MAILBOX_SET_CONN_FLAGS: {
+		struct xrt_mailbox_conn *conn = (struct xrt_mailbox_conn *)arg;
+
+		mbx->mbx_pkt_stream = !!(conn->xmic_conn_flags & XCL_MB_PEER_PKT_STREAM);
+		mbx->mbx_busy_nack = !!(conn->xmic_conn_flags & XCL_MB_PEER_BUSY_NACK);
+		mbx->mbx_compress = XRT_MAILBOX_LZ4 &&
+			(conn->xmic_conn_flags & XCL_MB_PEER_MSG_COMPRESS);
+		mbx->mbx_stripe = !!(conn->xmic_conn_flags & XCL_MB_PEER_MSG_STRIPE);
+		MBX_INFO(mbx, "packet streams %s, busy nack %s",
+			 mbx->mbx_pkt_stream ? "on" : "off", mbx->mbx_busy_nack ? "on" : "off");
 		break;
 	}
+	case XRT_MAILBOX_REQUEST_ASYNC:
+		ret = mailbox_request_async(pdev, (struct xrt_mailbox_request_async *)arg);
+		break;
+	case XRT_MAILBOX_LISTEN:
+		ret = mailbox_listen(pdev, (struct xrt_mailbox_listen *)arg);
+		break;
 	default:
 		MBX_ERR(mbx, "unknown cmd: %d", cmd);
 		ret = -EINVAL;
@@ -1490,13 +3687,128 @@ static int mailbox_leaf_call(struct platform_device *pdev, u32 cmd, void *arg)
 	return ret;
 }
 
+static irqreturn_t mailbox_isr(int irq, void *arg)
+{
+	struct mailbox *mbx = (struct mailbox *)arg;
+	u32 is = mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_is);
+	int rounds = 0;
+
+	/* Device is being reset or firewall tripped. */
+	if (is == 0xffffffff)
+		return IRQ_NONE;
+
+	while (is && rounds++ < MBX_ISR_MAX_ROUNDS) {
+		/* A packet has been drained by peer. */
+		if (is & FLAG_STI)
+			chan_wakeup(&mbx->mbx_tx);
+		/* A packet is waiting to be received. */
+		if (is & FLAG_RTI)
+			chan_wakeup(&mbx->mbx_rx);
+		/* Anything else is not expected. */
+		if (!(is & (FLAG_STI | FLAG_RTI)))
+			MBX_ERR(mbx, "spurious mailbox irq %d, is=0x%x", irq, is);
+
+		/* Clear intr state for receiving next one. */
+		mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_is, is);
+		is = mailbox_reg_rd(mbx, &mbx->mbx_regs->mbr_is);
+		if (is == 0xffffffff)
+			return IRQ_HANDLED;
+	}
+
+	/* Status keeps coming back, leave the rest to channel threads. */
+	if (is) {
+		mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_is, is);
+		chan_wakeup(&mbx->mbx_tx);
+		chan_wakeup(&mbx->mbx_rx);
+	}
+
+	return IRQ_HANDLED;
+}
+
+/* Obtain MSI-X vector mailbox is wired to from metadata. */
+static int mailbox_get_irq(struct mailbox *mbx)
+{
+	struct platform_device *pdev = mbx->mbx_pdev;
+	struct resource *res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+	const u32 *vec;
+	int ret;
+
+	if (!res)
+		return -EINVAL;
+
+	ret = xrt_md_get_prop(DEV(pdev), DEV_PDATA(pdev)->xsp_dtb, res->name, NULL,
+			      XRT_MD_PROP_INTERRUPTS, (const void **)&vec, NULL);
+	if (ret)
+		return ret;
+
+	return xleaf_get_irq(pdev, be32_to_cpu(*vec));
+}
+
+static void mailbox_disable_intr_mode(struct mailbox *mbx)
+{
+	if (!MBX_IRQ_MODE(mbx))
+		return;
+
+	mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_ie, 0x0);
+	if (mbx->mbx_irq < 0)
+		return;
+	free_irq(mbx->mbx_irq, mbx);
+	mbx->mbx_irq = -1;
+	MBX_INFO(mbx, "switched to polling mode");
+}
+
+static void mailbox_enable_intr_mode(struct mailbox *mbx)
+{
+	int irq, ret;
+
+	/* Disable both TX / RX intrs before we're ready. */
+	mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_ie, 0x0);
+
+	/* Loopback calls ISR directly, no irq line is needed. */
+	if (!mbx->mbx_sim) {
+		irq = mailbox_get_irq(mbx);
+		if (irq < 0) {
+			MBX_INFO(mbx, "no intr available, use polling mode");
+			return;
+		}
+
+		ret = request_irq(irq, mailbox_isr, 0, dev_name(DEV(mbx->mbx_pdev)), mbx);
+		if (ret) {
+			MBX_WARN(mbx, "failed to request irq %d: %d, use polling mode", irq, ret);
+			return;
+		}
+		mbx->mbx_irq = irq;
+	}
+
+	/* Clear stale intr state, then, enable TX / RX intrs. */
+	mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_is, FLAG_STI | FLAG_RTI);
+	mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_ie, FLAG_STI | FLAG_RTI);
+	MBX_INFO(mbx, "switched to intr mode, irq %d", mbx->mbx_irq);
+
+	/* Pick up whatever arrived before intr is enabled. */
+	chan_wakeup(&mbx->mbx_tx);
+	chan_wakeup(&mbx->mbx_rx);
+}
+
 static void mailbox_stop(struct mailbox *mbx)
 {
 	/* Tear down all threads. */
-	del_timer_sync(&mbx->mbx_poll_timer);
+	mailbox_disable_intr_mode(mbx);
+	mailbox_poll_unregister(mbx);
+	/*
+	 * Stop both channels before tearing down either one, since they may kick
+	 * each other, e.g., in loopback mode.
+	 */
+	chan_stop(&mbx->mbx_tx);
+	chan_stop(&mbx->mbx_rx);
 	chan_fini(&mbx->mbx_tx);
 	chan_fini(&mbx->mbx_rx);
+	mailbox_stripe_fini(mbx);
 	listen_wq_fini(mbx);
+	/* Callers have all gone, only responses kept for reuse are left. */
+	mutex_lock(&mbx->mbx_coalesce_lock);
+	mailbox_coalesce_expire(mbx, true);
+	mutex_unlock(&mbx->mbx_coalesce_lock);
 	WARN_ON(!(list_empty(&mbx->mbx_req_list)));
 }
 
@@ -1509,15 +3821,12 @@ static int mailbox_start(struct mailbox *mbx)
 	mbx->mbx_opened = 0;
 	mbx->mbx_listen_stop = false;
 
-	/* Dedicated thread for listening to peer request. */
-	mbx->mbx_listen_wq = create_singlethread_workqueue(dev_name(&mbx->mbx_pdev->dev));
-	if (!mbx->mbx_listen_wq) {
-		MBX_ERR(mbx, "failed to create request-listen work queue");
+	/* All threads are works on the shared workqueue. */
+	if (!mailbox_wq) {
+		MBX_ERR(mbx, "mailbox work queue is not available");
 		ret = -ENOMEM;
 		goto out;
 	}
-	INIT_WORK(&mbx->mbx_listen_worker, mailbox_recv_request);
-	queue_work(mbx->mbx_listen_wq, &mbx->mbx_listen_worker);
 
 	/* Set up communication channels. */
 	ret = chan_init(mbx, MBXCT_RX, &mbx->mbx_rx, chan_do_rx);
@@ -1531,15 +3840,17 @@ static int mailbox_start(struct mailbox *mbx)
 		goto out;
 	}
 
-	/* Only see status change when we have full packet sent or received. */
-	mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_rit, PACKET_SIZE - 1);
-	mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_sit, 0);
+	if (!MBX_SW_ONLY(mbx)) {
+		/* Only see status change when we have full packet sent or received. */
+		mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_rit, PACKET_SIZE - 1);
+		mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_sit, 0);
 
-	/* Disable both TX / RX intrs. We only do polling. */
-	if (!MBX_SW_ONLY(mbx))
-		mailbox_reg_wr(mbx, &mbx->mbx_regs->mbr_ie, 0x0);
-	timer_setup(&mbx->mbx_poll_timer, mailbox_poll_timer, 0);
-	mod_timer(&mbx->mbx_poll_timer, jiffies + MAILBOX_TTL_TIMER);
+		/* Use intr if it's wired up, otherwise, fall back to polling. */
+		mailbox_enable_intr_mode(mbx);
+	}
+	/* Msg time out is handled by channels, timer is only needed for polling. */
+	if (!MBX_IRQ_MODE(mbx))
+		mailbox_poll_register(mbx);
 
 out:
 	return ret;
@@ -1573,6 +3884,24 @@ static int mailbox_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+static void mailbox_sw_shm_fini(struct mailbox *mbx)
+{
+	WARN_ON(!mutex_is_locked(&mbx->mbx_lock));
+
+	if (!mbx->mbx_sw_shm)
+		return;
+
+	/*
+	 * Channels stop using the rings from now on. Freeing them here is only
+	 * safe because we're called from release(), which runs after the last
+	 * VMA of the file is gone, so no user mapping can still reach the pages.
+	 */
+	sw_ring_detach(&mbx->mbx_tx);
+	sw_ring_detach(&mbx->mbx_rx);
+	vfree(mbx->mbx_sw_shm);
+	mbx->mbx_sw_shm = NULL;
+}
+
 /*
  * Called when the device goes from used to unused.
  */
@@ -1581,6 +3910,8 @@ static int mailbox_close(struct inode *inode, struct file *file)
 	struct mailbox *mbx = file->private_data;
 
 	mutex_lock(&mbx->mbx_lock);
+	mailbox_sw_shm_fini(mbx);
+	mbx->mbx_sw_batch = false;
 	mbx->mbx_opened--;
 	mutex_unlock(&mbx->mbx_lock);
 	xleaf_devnode_close(inode);
@@ -1591,14 +3922,17 @@ static int mailbox_close(struct inode *inode, struct file *file)
  * Software channel TX handler. Msg goes out to peer.
  *
  * We either read the entire msg out or nothing and return error. Partial read
- * is not supported.
+ * is not supported. If daemon has asked for it, multiple msgs are returned back
+ * to back as long as they fit in the buffer (see XCL_SW_CHAN_REC_SIZE).
  */
 static ssize_t
 mailbox_read(struct file *file, char __user *buf, size_t n, loff_t *ignd)
 {
 	struct mailbox *mbx = file->private_data;
 	struct mailbox_channel *ch = &mbx->mbx_tx;
-	struct xcl_sw_chan args = { 0 };
+	size_t off = 0, len = 0, recsz;
+	struct sw_chan_msg *sm;
+	ssize_t ret = 0;
 
 	if (n < sizeof(struct xcl_sw_chan)) {
 		MBX_ERR(mbx, "Software TX buf has no room for header");
@@ -1617,54 +3951,74 @@ mailbox_read(struct file *file, char __user *buf, size_t n, loff_t *ignd)
 	mutex_lock(&ch->sw_chan_mutex);
 
 	/* Nothing to do. Someone is ahead of us and did the job? */
-	if (ch->sw_chan_msg_id == 0) {
+	if (list_empty(&ch->sw_chan_msgs)) {
 		mutex_unlock(&ch->sw_chan_mutex);
 		MBX_ERR(mbx, "Software TX channel is empty");
 		return 0;
 	}
 
-	/* Copy header to user. */
-	args.id = ch->sw_chan_msg_id;
-	args.sz = ch->sw_chan_buf_sz;
-	args.flags = ch->sw_chan_msg_flags;
-	if (copy_to_user(buf, &args, sizeof(struct xcl_sw_chan)) != 0) {
-		mutex_unlock(&ch->sw_chan_mutex);
-		return -EFAULT;
-	}
+	while ((sm = list_first_entry_or_null(&ch->sw_chan_msgs, struct sw_chan_msg, scm_list))) {
+		recsz = sizeof(struct xcl_sw_chan) + sm->scm_hdr.sz;
+		if (off + recsz > n) {
+			if (off)
+				break;
+			/*
+			 * Buffer passed in is too small for payload, return
+			 * header and EMSGSIZE to ask for a bigger one. This
+			 * occurs when daemons try to query the size of the
+			 * msg. Show it as info to avoid flushing system console.
+			 */
+			if (copy_to_user(buf, &sm->scm_hdr, sizeof(struct xcl_sw_chan)) != 0) {
+				ret = -EFAULT;
+			} else {
+				MBX_INFO(mbx, "Software TX msg is too big");
+				ret = -EMSGSIZE;
+			}
+			break;
+		}
 
-	/*
-	 * Buffer passed in is too small for payload, return EMSGSIZE to ask
-	 * for a bigger one.
-	 */
-	if (ch->sw_chan_buf_sz > (n - sizeof(struct xcl_sw_chan))) {
-		mutex_unlock(&ch->sw_chan_mutex);
-		/*
-		 * This error occurs when daemons try to query the size
-		 * of the msg. Show it as info to avoid flushing system console.
-		 */
-		MBX_INFO(mbx, "Software TX msg is too big");
-		return -EMSGSIZE;
-	}
+		/* Copy header and payload to user. */
+		if (copy_to_user(buf + off, &sm->scm_hdr,
+				 offsetof(struct xcl_sw_chan, data) + sm->scm_hdr.sz) != 0) {
+			ret = -EFAULT;
+			break;
+		}
 
-	/* Copy payload to user. */
-	if (copy_to_user(((struct xcl_sw_chan *)buf)->data,
-			 ch->sw_chan_buf, ch->sw_chan_buf_sz) != 0) {
-		mutex_unlock(&ch->sw_chan_mutex);
-		return -EFAULT;
-	}
+		/* Mark that job is done and we're ready for next TX msg. */
+		len = off + recsz;
+		off += XCL_SW_CHAN_REC_SIZE(sm->scm_hdr.sz);
+		free_sw_msg(sw_chan_msg_dequeue(ch));
 
-	/* Mark that job is done and we're ready for next TX msg. */
-	reset_sw_ch(ch);
+		if (!mbx->mbx_sw_batch)
+			break;
+	}
 
 	mutex_unlock(&ch->sw_chan_mutex);
-	return args.sz + sizeof(struct xcl_sw_chan);
+
+	if (!len)
+		return ret;
+	chan_wakeup(ch);
+	return len;
+}
+
+/* Handle control record from daemon. */
+static int mailbox_sw_ctrl(struct mailbox *mbx, struct xcl_sw_chan *args)
+{
+	if (args->sz != 0 || (args->flags & ~XCL_SW_CHAN_CTRL_BATCH_READ)) {
+		MBX_ERR(mbx, "Software RX msg has malformed header");
+		return -EINVAL;
+	}
+
+	mbx->mbx_sw_batch = !!(args->flags & XCL_SW_CHAN_CTRL_BATCH_READ);
+	return 0;
 }
 
 /*
  * Software channel RX handler. Msg comes in from peer.
  *
  * We either receive the entire msg or nothing and return error. Partial write
- * is not supported.
+ * is not supported. Multiple msgs can be passed in back to back, we'll take as
+ * many as there is room for in RX queue and return number of bytes consumed.
  */
 static ssize_t
 mailbox_write(struct file *file, const char __user *buf, size_t n, loff_t *ignd)
@@ -1672,7 +4026,9 @@ mailbox_write(struct file *file, const char __user *buf, size_t n, loff_t *ignd)
 	struct mailbox *mbx = file->private_data;
 	struct mailbox_channel *ch = &mbx->mbx_rx;
 	struct xcl_sw_chan args = { 0 };
-	void *payload = NULL;
+	size_t off = 0, len = 0;
+	struct sw_chan_msg *sm;
+	ssize_t ret = 0;
 
 	if (n < sizeof(struct xcl_sw_chan)) {
 		MBX_ERR(mbx, "Software RX msg has invalid header");
@@ -1681,76 +4037,167 @@ mailbox_write(struct file *file, const char __user *buf, size_t n, loff_t *ignd)
 
 	/* Wait until rx worker is ready for receiving next msg from peer. */
 	if (wait_event_interruptible(ch->sw_chan_wq,
-				     atomic_read(&ch->sw_num_pending_msg) == 0) == -ERESTARTSYS) {
+				     atomic_read(&ch->sw_num_pending_msg) <
+				     MAX_SW_MSG_QUEUE_LEN) == -ERESTARTSYS) {
 		MBX_ERR(mbx, "Software RX channel handler is interrupted");
 		return -ERESTARTSYS;
 	}
 
 	/* Rx worker is ready to receive msg, do it now. */
 
-	mutex_lock(&ch->sw_chan_mutex);
+	while (off + sizeof(struct xcl_sw_chan) <= n) {
+		/* Copy header from user. */
+		if (copy_from_user(&args, buf + off, sizeof(struct xcl_sw_chan)) != 0) {
+			ret = -EFAULT;
+			break;
+		}
+		if (args.id == 0) {
+			ret = mailbox_sw_ctrl(mbx, &args);
+			if (ret)
+				break;
+			len = off + sizeof(struct xcl_sw_chan);
+			off += XCL_SW_CHAN_REC_SIZE(0);
+			continue;
+		}
+		if (args.sz == 0) {
+			MBX_ERR(mbx, "Software RX msg has malformed header");
+			ret = -EINVAL;
+			break;
+		}
 
-	/* No room for us. Someone is ahead of us and is using the channel? */
-	if (ch->sw_chan_msg_id != 0) {
-		mutex_unlock(&ch->sw_chan_mutex);
-		MBX_ERR(mbx, "Software RX channel is busy");
-		return -EBUSY;
-	}
+		/* Copy payload from user. */
+		if (args.sz > n - off - sizeof(struct xcl_sw_chan)) {
+			MBX_ERR(mbx, "Software RX msg has invalid payload");
+			ret = -EINVAL;
+			break;
+		}
+		sm = alloc_sw_msg(args.id, args.flags, args.sz);
+		if (!sm) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (copy_from_user(sm->scm_hdr.data, buf + off + offsetof(struct xcl_sw_chan, data),
+				   args.sz) != 0) {
+			free_sw_msg(sm);
+			ret = -EFAULT;
+			break;
+		}
 
-	/* Copy header from user. */
-	if (copy_from_user(&args, buf, sizeof(struct xcl_sw_chan)) != 0) {
+		mutex_lock(&ch->sw_chan_mutex);
+		/* No room for us. Someone is ahead of us and is using the channel? */
+		if (atomic_read(&ch->sw_num_pending_msg) >= MAX_SW_MSG_QUEUE_LEN) {
+			mutex_unlock(&ch->sw_chan_mutex);
+			free_sw_msg(sm);
+			ret = -EBUSY;
+			break;
+		}
+		/* Set up received msg and notify rx worker. */
+		sw_chan_msg_enqueue(ch, sm);
 		mutex_unlock(&ch->sw_chan_mutex);
-		return -EFAULT;
+
+		len = off + sizeof(struct xcl_sw_chan) + args.sz;
+		off += XCL_SW_CHAN_REC_SIZE(args.sz);
 	}
-	if (args.id == 0 || args.sz == 0) {
-		mutex_unlock(&ch->sw_chan_mutex);
-		MBX_ERR(mbx, "Software RX msg has malformed header");
+
+	if (!len)
+		return ret;
+	chan_wakeup(ch);
+	return len;
+}
+
+/*
+ * Software channel shared memory. Setting up rings for passing msgs b/w driver
+ * and daemon without extra copy or syscall for each msg.
+ */
+static int mailbox_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct mailbox *mbx = file->private_data;
+	size_t sz = PAGE_ALIGN(XCL_SW_CHAN_SHM_SIZE);
+	struct xcl_sw_chan_shm *shm;
+	int ret;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != sz) {
+		MBX_ERR(mbx, "Software channel shm should be mapped at 0 with %zu bytes", sz);
 		return -EINVAL;
 	}
 
-	/* Copy payload from user. */
-	if (n < args.sz + sizeof(struct xcl_sw_chan)) {
-		mutex_unlock(&ch->sw_chan_mutex);
-		MBX_ERR(mbx, "Software RX msg has invalid payload");
-		return -EINVAL;
+	mutex_lock(&mbx->mbx_lock);
+
+	if (mbx->mbx_sw_shm) {
+		mutex_unlock(&mbx->mbx_lock);
+		return -EBUSY;
 	}
-	payload = vmalloc(args.sz);
-	if (!payload) {
-		mutex_unlock(&ch->sw_chan_mutex);
+
+	shm = vmalloc_user(sz);
+	if (!shm) {
+		mutex_unlock(&mbx->mbx_lock);
 		return -ENOMEM;
 	}
-	if (copy_from_user(payload, ((struct xcl_sw_chan *)buf)->data, args.sz) != 0) {
-		mutex_unlock(&ch->sw_chan_mutex);
-		vfree(payload);
-		return -EFAULT;
+	shm->version = XCL_SW_CHAN_SHM_VERSION;
+	shm->size = XCL_SW_CHAN_SHM_SIZE;
+	shm->tx.num_slots = XCL_SW_CHAN_RING_NUM_SLOTS;
+	shm->tx.slot_size = XCL_SW_CHAN_RING_SLOT_SIZE;
+	shm->tx.slot_offset = XCL_SW_CHAN_SHM_HDR_SIZE;
+	shm->rx.num_slots = XCL_SW_CHAN_RING_NUM_SLOTS;
+	shm->rx.slot_size = XCL_SW_CHAN_RING_SLOT_SIZE;
+	shm->rx.slot_offset = XCL_SW_CHAN_SHM_HDR_SIZE +
+		XCL_SW_CHAN_RING_NUM_SLOTS * XCL_SW_CHAN_RING_SLOT_SIZE;
+
+	ret = remap_vmalloc_range(vma, shm, 0);
+	if (ret) {
+		mutex_unlock(&mbx->mbx_lock);
+		vfree(shm);
+		MBX_ERR(mbx, "failed to map software channel shm: %d", ret);
+		return ret;
 	}
 
-	/* Set up received msg and notify rx worker. */
-	ch->sw_chan_buf_sz = args.sz;
-	ch->sw_chan_msg_id = args.id;
-	ch->sw_chan_msg_flags = args.flags;
-	ch->sw_chan_buf = payload;
-
-	atomic_inc(&ch->sw_num_pending_msg);
+	mbx->mbx_sw_shm = shm;
+	sw_ring_attach(&mbx->mbx_tx, shm);
+	sw_ring_attach(&mbx->mbx_rx, shm);
 
-	mutex_unlock(&ch->sw_chan_mutex);
+	mutex_unlock(&mbx->mbx_lock);
 
-	return args.sz + sizeof(struct xcl_sw_chan);
+	/* Pending TX msg may go through the ring now. */
+	chan_wakeup(&mbx->mbx_tx);
+	return 0;
 }
 
 static uint mailbox_poll(struct file *file, poll_table *wait)
 {
 	struct mailbox *mbx = file->private_data;
 	struct mailbox_channel *ch = &mbx->mbx_tx;
+	struct mailbox_channel *rxch = &mbx->mbx_rx;
+	uint mask = 0;
+	u32 txcnt, rxcnt;
 	int counter;
 
 	poll_wait(file, &ch->sw_chan_wq, wait);
+	poll_wait(file, &rxch->sw_chan_wq, wait);
 	counter = atomic_read(&ch->sw_num_pending_msg);
 
-	MBX_DBG(mbx, "%s: %d", __func__, counter);
-	if (counter == 0)
-		return 0;
-	return POLLIN;
+	mutex_lock(&ch->sw_chan_mutex);
+	txcnt = sw_ring_used(ch);
+	mutex_unlock(&ch->sw_chan_mutex);
+	mutex_lock(&rxch->sw_chan_mutex);
+	rxcnt = sw_ring_used(rxch);
+	if ((rxch->sw_chan_ring && rxcnt < XCL_SW_CHAN_RING_NUM_SLOTS) ||
+	    atomic_read(&rxch->sw_num_pending_msg) < MAX_SW_MSG_QUEUE_LEN)
+		mask |= POLLOUT;
+	mutex_unlock(&rxch->sw_chan_mutex);
+
+	/*
+	 * Daemon calls in here after producing into RX ring or consuming from
+	 * TX ring, kick channel threads to pick up the change.
+	 */
+	if (rxcnt)
+		chan_wakeup(rxch);
+	if (READ_ONCE(ch->mbc_cur_msg))
+		chan_wakeup(ch);
+
+	MBX_DBG(mbx, "%s: %d %u %u", __func__, counter, txcnt, rxcnt);
+	if (counter || txcnt)
+		mask |= POLLIN;
+	return mask;
 }
 
 static int mailbox_remove(struct platform_device *pdev)
@@ -1760,13 +4207,25 @@ static int mailbox_remove(struct platform_device *pdev)
 	/* Stop accessing from sysfs node. */
 	sysfs_remove_group(&pdev->dev.kobj, &mailbox_attrgroup);
 	mailbox_stop(mbx);
-	if (mbx->mbx_regs)
+	if (mbx->mbx_regs && !mbx->mbx_sim)
 		iounmap(mbx->mbx_regs);
 	MBX_INFO(mbx, "mailbox cleaned up successfully");
 	platform_set_drvdata(pdev, NULL);
 	return 0;
 }
 
+/* Closest NUMA node to the card, if anyone in the device tree knows it. */
+static int mailbox_numa_node(struct platform_device *pdev)
+{
+	struct device *dev;
+
+	for (dev = DEV(pdev); dev; dev = dev->parent) {
+		if (dev_to_node(dev) != NUMA_NO_NODE)
+			return dev_to_node(dev);
+	}
+	return NUMA_NO_NODE;
+}
+
 static int mailbox_probe(struct platform_device *pdev)
 {
 	struct mailbox *mbx = NULL;
@@ -1778,15 +4237,43 @@ static int mailbox_probe(struct platform_device *pdev)
 		return -ENOMEM;
 
 	mbx->mbx_pdev = pdev;
+	mbx->mbx_irq = -1;
+	mbx->mbx_burst = true;
+	mbx->mbx_poll_spin_us = MAILBOX_POLL_SPIN_US;
+	mbx->mbx_poll_min_us = MAILBOX_POLL_MIN_US;
+	mbx->mbx_poll_max_us = MAILBOX_POLL_MAX_US;
+	mbx->mbx_req_max = MAX_MSG_QUEUE_LEN;
+	mbx->mbx_compress_min = MSG_COMPRESS_MIN_SZ;
+	mbx->mbx_stripe_sw_pct = MSG_STRIPE_SW_PCT;
+	mbx->mbx_coalesce_on = true;
+	mbx->mbx_node = mailbox_numa_node(pdev);
 	platform_set_drvdata(pdev, mbx);
 
-	init_completion(&mbx->mbx_comp);
 	mutex_init(&mbx->mbx_lock);
 	mutex_init(&mbx->mbx_listen_cb_lock);
 	INIT_LIST_HEAD(&mbx->mbx_req_list);
+	INIT_LIST_HEAD(&mbx->mbx_poll_node);
+	INIT_LIST_HEAD(&mbx->mbx_stripes);
+	mutex_init(&mbx->mbx_coalesce_lock);
+	INIT_LIST_HEAD(&mbx->mbx_coalesce);
+	INIT_WORK(&mbx->mbx_listen_worker, mailbox_recv_request);
+	mutex_init(&mbx->mbx_lz4_lock);
+	/* Msgs are just not compressed if this fails. */
+	if (XRT_MAILBOX_LZ4)
+		mbx->mbx_lz4_wrkmem = devm_kmalloc(DEV(pdev), LZ4_MEM_COMPRESS, GFP_KERNEL);
 
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	if (res) {
+	if (!xrt_md_find_endpoint(DEV(pdev), DEV_PDATA(pdev)->xsp_dtb,
+				  XRT_MD_NODE_MAILBOX_LOOPBACK, NULL, NULL)) {
+		mbx->mbx_sim = devm_kzalloc(DEV(pdev), sizeof(*mbx->mbx_sim), GFP_KERNEL);
+		if (!mbx->mbx_sim) {
+			ret = -ENOMEM;
+			goto failed;
+		}
+		spin_lock_init(&mbx->mbx_sim->ms_lock);
+		mbx->mbx_regs = &mbx->mbx_sim->ms_regs;
+		MBX_INFO(mbx, "running in loopback mode");
+	} else if (res) {
 		mbx->mbx_regs = ioremap(res->start, res->end - res->start + 1);
 		if (!mbx->mbx_regs) {
 			MBX_ERR(mbx, "failed to map in registers");
@@ -1822,6 +4309,13 @@ static struct xrt_subdev_endpoints xrt_mailbox_endpoints[] = {
 		},
 		.xse_min_ep = 1,
 	},
+	{
+		.xse_names = (struct xrt_subdev_ep_names []){
+			{ .ep_name = XRT_MD_NODE_MAILBOX_LOOPBACK},
+			{ NULL },
+		},
+		.xse_min_ep = 1,
+	},
 	{ 0 },
 };
 
@@ -1837,6 +4331,7 @@ static struct xrt_subdev_drvdata mailbox_drvdata = {
 			.read = mailbox_read,
 			.write = mailbox_write,
 			.poll = mailbox_poll,
+			.mmap = mailbox_mmap,
 		},
 		.xsf_dev_name = "mailbox",
 	},
@@ -1861,9 +4356,18 @@ static struct platform_driver xrt_mailbox_driver = {
 void mailbox_leaf_init_fini(bool init)
 {
 	if (init) {
+		mailbox_msg_cache_init();
+		mailbox_wq = alloc_workqueue("xrt_mailbox",
+					     WQ_UNBOUND | WQ_MEM_RECLAIM | WQ_SYSFS, 0);
 		xleaf_register_driver(XRT_SUBDEV_MAILBOX,
 				      &xrt_mailbox_driver, xrt_mailbox_endpoints);
 	} else {
 		xleaf_unregister_driver(XRT_SUBDEV_MAILBOX);
+		del_timer_sync(&mailbox_poll_ticker);
+		if (mailbox_wq) {
+			destroy_workqueue(mailbox_wq);
+			mailbox_wq = NULL;
+		}
+		mailbox_msg_cache_fini();
 	}
 }
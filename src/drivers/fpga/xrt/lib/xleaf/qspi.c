@@ -10,6 +10,11 @@
 
 #include <linux/delay.h>
 #include <linux/uaccess.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/xrt/flash-ioctl.h>
 #include "metadata.h"
 #include "xleaf.h"
 #include "xleaf/flash.h"
@@ -136,6 +141,18 @@ static inline size_t QSPI_PAGE_ROUNDUP(loff_t offset)
 	return offset + QSPI_PAGE_SIZE;
 }
 
+/*
+ * Flash memory is programmed in units of program page. Each program cmd
+ * should not cross program page boundary.
+ */
+#define QSPI_PROG_PAGE_SIZE	256UL
+
+/*
+ * Default size limit of flash page cache. It's off, since cached pages are
+ * pinned, users opt in through cache_size sysfs node.
+ */
+#define QSPI_CACHE_DEFAULT_MB	0
+
 /*
  * Wait for condition to be true for at most 1 second.
  * Return true, if time'd out, false otherwise.
@@ -234,6 +251,63 @@ struct qspi_reg {
 	u32	qspi_rx_fifo;
 } __packed;
 
+/*
+ * One image of a flash job. The image is programmed one erase unit after
+ * another, each unit goes through read-back and compare, erase (if needed),
+ * program and verify (if asked). Erase and program are only started here,
+ * @busy is set until flash device is ready again, so that the worker can feed
+ * the other flash device in the meantime.
+ */
+struct qspi_job_img {
+	int slave;
+	struct file *file;	/* image is read from this file, or */
+	u8 *image;		/* image is copied in at submission */
+	loff_t pos;		/* file position to read from */
+	loff_t off;		/* flash offset, including slave */
+	size_t size;
+	size_t done;		/* image bytes done */
+
+	u8 *pre;		/* image data of next unit read ahead from file */
+	size_t pre_len;
+	u8 *buf;		/* new content of current unit */
+	u8 *old;		/* flash content of current unit */
+	u8 *vbuf;		/* read back for verify */
+	bool in_unit;		/* current unit is being updated */
+	bool busy;		/* flash is still busy with last cmd */
+	bool erasing;		/* last cmd is erase */
+	loff_t unit_off;
+	size_t unit_len;
+	size_t unit_data;	/* image bytes in current unit */
+	size_t prog_pos;	/* next byte in unit to program */
+	size_t prog_end;
+};
+
+/*
+ * Asynchronous flash programming job, see include/uapi/linux/xrt/flash-ioctl.h.
+ * State and progress are protected by lock, the rest is owned by submitter
+ * until the job is queued and by the worker afterwards.
+ */
+struct qspi_job {
+	struct work_struct work;
+	spinlock_t lock;	/* protects state and progress */
+	wait_queue_head_t wq;
+	bool cancel;
+
+	struct qspi_job_img images[XRT_FLASH_JOB_MAX_IMAGES];
+	u32 num_images;
+	u32 flags;
+
+	u32 state;
+	int err;
+	u32 sync_writers;	/* write() in progress, no job can be submitted */
+	size_t size;
+	u64 erased;
+	u64 programmed;
+	u64 verified;
+	ktime_t start;
+	ktime_t end;
+};
+
 struct xrt_qspi {
 	struct platform_device	*pdev;
 	struct resource *res;
@@ -242,9 +316,36 @@ struct xrt_qspi {
 	u8 *io_buf;
 	struct qspi_reg *qspi_regs;
 	size_t qspi_fifo_depth;
-	u8 qspi_curr_sector;
+	u8 qspi_curr_sector[MAX_NUM_OF_SLAVES];
 	struct qspi_flash_vendor *vendor;
 	int qspi_curr_slave;
+
+	/*
+	 * Differential write. Erase unit is read back and compared with new data
+	 * before being erased and programmed.
+	 */
+	bool diff_write;
+	u8 *diff_buf;
+	u64 diff_skipped;
+	u64 diff_programmed;
+	u64 diff_erased;
+	u64 ff_skipped;
+
+	struct qspi_job job;
+
+	/*
+	 * Page cache of flash content, one entry per PAGE_SIZE bytes of each
+	 * flash device, filled on read and dropped on erase or program. Also
+	 * serves mmap of flash device node. Protected by io_lock.
+	 */
+	struct page **cache;
+	size_t cache_entries;
+	size_t cache_used;	/* in pages */
+	size_t cache_max;	/* in pages, 0 means disabled */
+	size_t cache_hand;	/* next entry to look at for eviction */
+	struct address_space *cache_mapping;	/* set while mmap'ed */
+	u64 cache_hits;
+	u64 cache_misses;
 };
 
 static inline const char *reg2name(struct xrt_qspi *flash, u32 *reg)
@@ -535,7 +636,7 @@ static int qspi_set_sector(struct xrt_qspi *flash, u8 sector)
 	int ret = 0;
 	u8 cmd[] = { QSPI_CMD_EXTENDED_ADDRESS_REG_WRITE, sector };
 
-	if (sector == flash->qspi_curr_sector)
+	if (sector == flash->qspi_curr_sector[flash->qspi_curr_slave])
 		return 0;
 
 	QSPI_DBG(flash, "setting sector to %d", sector);
@@ -550,7 +651,7 @@ static int qspi_set_sector(struct xrt_qspi *flash, u8 sector)
 		return ret;
 	}
 
-	flash->qspi_curr_sector = sector;
+	flash->qspi_curr_sector[flash->qspi_curr_slave] = sector;
 	return ret;
 }
 
@@ -579,6 +680,70 @@ static inline loff_t qspi_faddr2offset(struct qspi_flash_addr *faddr)
 	return off;
 }
 
+static inline size_t qspi_cache_idx(struct xrt_qspi *flash, loff_t off)
+{
+	struct qspi_flash_addr faddr;
+	size_t slave;
+
+	qspi_offset2faddr(off, &faddr);
+	slave = faddr.slave;
+	faddr.slave = 0;
+	return slave * (flash->flash_size >> PAGE_SHIFT) +
+		(qspi_faddr2offset(&faddr) >> PAGE_SHIFT);
+}
+
+static inline loff_t qspi_cache_idx2off(struct xrt_qspi *flash, size_t idx)
+{
+	size_t pages = flash->flash_size >> PAGE_SHIFT;
+
+	return ((loff_t)(idx / pages) << 56) | ((loff_t)(idx % pages) << PAGE_SHIFT);
+}
+
+/* Drop one cached page. Its user mapping, if any, is zapped first. */
+static void qspi_cache_drop(struct xrt_qspi *flash, size_t idx)
+{
+	struct page *page = flash->cache[idx];
+
+	if (!page)
+		return;
+
+	if (flash->cache_mapping)
+		unmap_mapping_range(flash->cache_mapping, qspi_cache_idx2off(flash, idx),
+				    PAGE_SIZE, 1);
+	flash->cache[idx] = NULL;
+	flash->cache_used--;
+	put_page(page);
+}
+
+/* Cached pages are evicted round robin. */
+static void qspi_cache_evict(struct xrt_qspi *flash)
+{
+	size_t i;
+
+	for (i = 0; i < flash->cache_entries && flash->cache_used; i++) {
+		size_t idx = flash->cache_hand;
+
+		flash->cache_hand = (idx + 1) % flash->cache_entries;
+		if (flash->cache[idx]) {
+			qspi_cache_drop(flash, idx);
+			return;
+		}
+	}
+}
+
+/* Flash content is about to change, drop cached pages in the range. */
+static void qspi_cache_invalidate(struct xrt_qspi *flash, loff_t off, size_t len)
+{
+	size_t idx, end;
+
+	if (!flash->cache_used)
+		return;
+
+	end = qspi_cache_idx(flash, off + len - 1);
+	for (idx = qspi_cache_idx(flash, off); idx <= end && idx < flash->cache_entries; idx++)
+		qspi_cache_drop(flash, idx);
+}
+
 /* IO cmd starts with op code followed by address. */
 static inline int qspi_setup_io_cmd_header(struct xrt_qspi *flash,
 					   u8 op, struct qspi_flash_addr *faddr, size_t *header_len)
@@ -660,10 +825,11 @@ static int qspi_fifo_rd(struct xrt_qspi *flash, loff_t off, u8 *buf, size_t *cnt
 }
 
 /*
- * Do one FIFO write to flash. Assuming erase is already done.
+ * Start one FIFO write to flash w/o waiting for flash to finish programming.
+ * Assuming erase is already done.
  * @cnt contains bytes actually written on successful return.
  */
-static int qspi_fifo_wr(struct xrt_qspi *flash, loff_t off, u8 *buf, size_t *cnt)
+static int qspi_fifo_wr_start(struct xrt_qspi *flash, loff_t off, u8 *buf, size_t *cnt)
 {
 	/*
 	 * For write cmd, we can't write more than write_max_len bytes in one
@@ -692,6 +858,15 @@ static int qspi_fifo_wr(struct xrt_qspi *flash, loff_t off, u8 *buf, size_t *cnt
 	payload_len = min(payload_len, write_max_len);
 	total_len = payload_len + header_len;
 
+	qspi_cache_invalidate(flash, off, payload_len);
+
+	/* Programming all ones is a no-op on NOR flash, skip it. */
+	if (!memchr_inv(buf, 0xff, payload_len)) {
+		flash->ff_skipped += payload_len;
+		*cnt = payload_len;
+		return 0;
+	}
+
 	QSPI_DBG(flash, "writing %zu bytes @0x%llx", payload_len, off);
 
 	/* Copy in payload after header. */
@@ -705,13 +880,24 @@ static int qspi_fifo_wr(struct xrt_qspi *flash, loff_t off, u8 *buf, size_t *cnt
 	ret = qspi_exec_io_cmd(flash, total_len, false);
 	if (ret)
 		return ret;
-	if (!qspi_wait_until_ready(flash))
-		return -EINVAL;
 
 	*cnt = payload_len;
 	return 0;
 }
 
+/*
+ * Do one FIFO write to flash. Assuming erase is already done.
+ * @cnt contains bytes actually written on successful return.
+ */
+static int qspi_fifo_wr(struct xrt_qspi *flash, loff_t off, u8 *buf, size_t *cnt)
+{
+	int ret = qspi_fifo_wr_start(flash, off, buf, cnt);
+
+	if (ret == 0 && !qspi_wait_until_ready(flash))
+		ret = -EINVAL;
+	return ret;
+}
+
 /*
  * Load/store the whole buf of data from/to flash memory.
  */
@@ -736,6 +922,22 @@ static int qspi_buf_rdwr(struct xrt_qspi *flash, u8 *buf, loff_t off, size_t len
 	return ret;
 }
 
+/*
+ * Read back flash content of an erase unit, one flash page at a time, since
+ * flash read should not cross flash page boundary.
+ */
+static int qspi_unit_rd(struct xrt_qspi *flash, u8 *buf, loff_t off, size_t len)
+{
+	size_t i, thislen;
+	int ret = 0;
+
+	for (i = 0; ret == 0 && i < len; i += thislen) {
+		thislen = min_t(size_t, len - i, QSPI_PAGE_ROUNDUP(off + i) - (off + i));
+		ret = qspi_buf_rdwr(flash, buf + i, off + i, thislen, false);
+	}
+	return ret;
+}
+
 static u8 qspi_erase_cmd(size_t pagesz)
 {
 	u8 cmd = 0;
@@ -760,9 +962,9 @@ static u8 qspi_erase_cmd(size_t pagesz)
 }
 
 /*
- * Erase one flash page.
+ * Start erasing one flash page w/o waiting for flash to finish.
  */
-static int qspi_page_erase(struct xrt_qspi *flash, loff_t off, size_t pagesz)
+static int qspi_page_erase_start(struct xrt_qspi *flash, loff_t off, size_t pagesz)
 {
 	int ret = 0;
 	struct qspi_flash_addr faddr;
@@ -772,6 +974,7 @@ static int qspi_page_erase(struct xrt_qspi *flash, loff_t off, size_t pagesz)
 	QSPI_DBG(flash, "Erasing 0x%lx bytes @0x%llx with cmd=0x%x", pagesz, off, (u32)cmd);
 	WARN_ON(!IS_ALIGNED(off, pagesz));
 	qspi_offset2faddr(off, &faddr);
+	qspi_cache_invalidate(flash, off, pagesz);
 
 	if (!qspi_wait_until_ready(flash))
 		return -EINVAL;
@@ -790,12 +993,21 @@ static int qspi_page_erase(struct xrt_qspi *flash, loff_t off, size_t pagesz)
 		return ret;
 	}
 
-	if (!qspi_wait_until_ready(flash))
-		return -EINVAL;
-
 	return 0;
 }
 
+/*
+ * Erase one flash page.
+ */
+static int qspi_page_erase(struct xrt_qspi *flash, loff_t off, size_t pagesz)
+{
+	int ret = qspi_page_erase_start(flash, off, pagesz);
+
+	if (ret == 0 && !qspi_wait_until_ready(flash))
+		ret = -EINVAL;
+	return ret;
+}
+
 static bool is_valid_offset(struct xrt_qspi *flash, loff_t off)
 {
 	struct qspi_flash_addr faddr;
@@ -809,6 +1021,91 @@ static bool is_valid_offset(struct xrt_qspi *flash, loff_t off)
 	return qspi_faddr2offset(&faddr) < flash->flash_size;
 }
 
+/*
+ * Look up cached page for the flash offset, fill it from flash on miss.
+ * Caller should hold io_lock, and should get_page() if it uses the page
+ * after io_lock is released.
+ */
+static int qspi_cache_get(struct xrt_qspi *flash, loff_t off, struct page **pagep)
+{
+	size_t idx = qspi_cache_idx(flash, off);
+	struct qspi_flash_addr faddr;
+	struct page *page;
+	size_t i;
+	int ret = 0;
+
+	if (!flash->cache_max)
+		return -EOPNOTSUPP;
+	if (!is_valid_offset(flash, off) || idx >= flash->cache_entries)
+		return -EINVAL;
+
+	page = flash->cache[idx];
+	if (page) {
+		flash->cache_hits++;
+		*pagep = page;
+		return 0;
+	}
+	flash->cache_misses++;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	qspi_offset2faddr(off, &faddr);
+	flash->qspi_curr_slave = faddr.slave;
+	if (!qspi_wait_until_ready(flash))
+		ret = -EINVAL;
+	/* Flash read should not cross flash page boundary. */
+	off = qspi_cache_idx2off(flash, idx);
+	for (i = 0; ret == 0 && i < PAGE_SIZE; i += QSPI_PAGE_SIZE)
+		ret = qspi_buf_rdwr(flash, (u8 *)page_address(page) + i, off + i,
+				    QSPI_PAGE_SIZE, false);
+	if (ret) {
+		put_page(page);
+		return ret;
+	}
+
+	while (flash->cache_used >= flash->cache_max)
+		qspi_cache_evict(flash);
+	flash->cache[idx] = page;
+	flash->cache_used++;
+	*pagep = page;
+	return 0;
+}
+
+/* Read from page cache. Caller should hold io_lock. */
+static int qspi_cache_read(struct xrt_qspi *flash, char *kbuf, size_t n, loff_t off)
+{
+	struct page *page;
+	size_t cnt = 0;
+	int ret;
+
+	while (cnt < n) {
+		loff_t thisoff = off + cnt;
+		size_t pgoff = thisoff & ~PAGE_MASK;
+		size_t thislen = min(n - cnt, PAGE_SIZE - pgoff);
+
+		ret = qspi_cache_get(flash, thisoff, &page);
+		if (ret)
+			return ret;
+		memcpy(&kbuf[cnt], (u8 *)page_address(page) + pgoff, thislen);
+		cnt += thislen;
+	}
+	return 0;
+}
+
+/* Range should be within one flash device. */
+static bool is_valid_range(struct xrt_qspi *flash, loff_t off, size_t len)
+{
+	struct qspi_flash_addr faddr;
+
+	qspi_offset2faddr(off, &faddr);
+	if (faddr.slave >= MAX_NUM_OF_SLAVES)
+		return false;
+	faddr.slave = 0;
+	return len <= flash->flash_size && qspi_faddr2offset(&faddr) <= flash->flash_size - len;
+}
+
 static int
 qspi_do_read(struct xrt_qspi *flash, char *kbuf, size_t n, loff_t off)
 {
@@ -817,12 +1114,19 @@ qspi_do_read(struct xrt_qspi *flash, char *kbuf, size_t n, loff_t off)
 	struct qspi_flash_addr faddr;
 	int ret = 0;
 
-	page = vmalloc(QSPI_PAGE_SIZE);
-	if (!page)
-		return -ENOMEM;
-
 	mutex_lock(&flash->io_lock);
 
+	if (flash->cache_max) {
+		ret = qspi_cache_read(flash, kbuf, n, off);
+		goto done;
+	}
+
+	page = vmalloc(QSPI_PAGE_SIZE);
+	if (!page) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
 	qspi_offset2faddr(off, &faddr);
 	flash->qspi_curr_slave = faddr.slave;
 
@@ -842,6 +1146,7 @@ qspi_do_read(struct xrt_qspi *flash, char *kbuf, size_t n, loff_t off)
 		cnt += thislen;
 	}
 
+done:
 	mutex_unlock(&flash->io_lock);
 	vfree(page);
 	return ret;
@@ -855,6 +1160,7 @@ qspi_read(struct file *file, char __user *ubuf, size_t n, loff_t *off)
 {
 	struct xrt_qspi *flash = file->private_data;
 	char *kbuf = NULL;
+	size_t cnt = 0;
 	int ret = 0;
 
 	QSPI_INFO(flash, "reading %zu bytes @0x%llx", n, *off);
@@ -864,14 +1170,21 @@ qspi_read(struct file *file, char __user *ubuf, size_t n, loff_t *off)
 		return 0;
 	}
 	n = min(n, flash->flash_size - (size_t)*off);
-	kbuf = vmalloc(n);
+	kbuf = vmalloc(min(n, QSPI_HUGE_PAGE_SIZE));
 	if (!kbuf)
 		return -ENOMEM;
 
-	ret = qspi_do_read(flash, kbuf, n, *off);
-	if (ret == 0) {
-		if (copy_to_user(ubuf, kbuf, n) != 0)
+	/*
+	 * Bounce through a small buffer, user buf is touched w/o holding io_lock,
+	 * since it could be mmap'ed flash and faulting it in needs io_lock.
+	 */
+	while (ret == 0 && cnt < n) {
+		size_t thislen = min(n - cnt, QSPI_HUGE_PAGE_SIZE);
+
+		ret = qspi_do_read(flash, kbuf, thislen, *off + cnt);
+		if (ret == 0 && copy_to_user(ubuf + cnt, kbuf, thislen) != 0)
 			ret = -EFAULT;
+		cnt += thislen;
 	}
 	vfree(kbuf);
 
@@ -891,12 +1204,109 @@ static int qspi_kernel_read(struct platform_device *pdev, char *buf, size_t n, l
 	return qspi_do_read(flash, buf, n, off);
 }
 
+/* Keep flash job out while write() is in progress, fail if one is running. */
+static int qspi_sync_write_begin(struct xrt_qspi *flash)
+{
+	int ret = 0;
+
+	spin_lock(&flash->job.lock);
+	if (flash->job.state == XRT_FLASH_JOB_RUNNING)
+		ret = -EBUSY;
+	else
+		flash->job.sync_writers++;
+	spin_unlock(&flash->job.lock);
+	return ret;
+}
+
+static void qspi_sync_write_end(struct xrt_qspi *flash)
+{
+	spin_lock(&flash->job.lock);
+	flash->job.sync_writers--;
+	spin_unlock(&flash->job.lock);
+}
+
+enum qspi_diff_result {
+	QSPI_DIFF_SAME,
+	QSPI_DIFF_PROGRAM,
+	QSPI_DIFF_ERASE,
+};
+
+/*
+ * Compare new data with current flash content. Programming can only turn bits
+ * from 1 to 0, anything else needs erase. When program is enough, [*start, *end)
+ * is set to the range to be programmed, aligned to program page. A unit which
+ * is already erased (all ones) is never erased again.
+ */
+static enum qspi_diff_result
+qspi_page_diff(const u8 *old, const u8 *new, size_t len, size_t *start, size_t *end)
+{
+	size_t i, first = len, last = 0;
+
+	if (memcmp(old, new, len) == 0)
+		return QSPI_DIFF_SAME;
+
+	for (i = 0; i < len; i++) {
+		if (old[i] == new[i])
+			continue;
+		if ((old[i] & new[i]) != new[i])
+			return QSPI_DIFF_ERASE;
+		if (first == len)
+			first = i;
+		last = i;
+	}
+
+	*start = round_down(first, QSPI_PROG_PAGE_SIZE);
+	*end = min(round_up(last + 1, QSPI_PROG_PAGE_SIZE), len);
+	return QSPI_DIFF_PROGRAM;
+}
+
+/*
+ * Update one erase unit with new data in kbuf. In differential mode, current
+ * content is read back first, unless caller has already done so into
+ * flash->diff_buf. Unchanged unit is skipped and unit which only needs bits
+ * to be cleared is programmed without being erased.
+ */
+static int qspi_page_update(struct xrt_qspi *flash, u8 *kbuf, loff_t off, size_t len,
+			    bool old_loaded)
+{
+	size_t start, end;
+	int ret;
+
+	if (flash->diff_write) {
+		if (!old_loaded) {
+			ret = qspi_unit_rd(flash, flash->diff_buf, off, len);
+			if (ret)
+				return ret;
+		}
+
+		switch (qspi_page_diff(flash->diff_buf, kbuf, len, &start, &end)) {
+		case QSPI_DIFF_SAME:
+			QSPI_DBG(flash, "skipping 0x%lx bytes @0x%llx", len, off);
+			flash->diff_skipped++;
+			return 0;
+		case QSPI_DIFF_PROGRAM:
+			QSPI_DBG(flash, "programming w/o erase 0x%lx bytes @0x%llx",
+				 end - start, off + start);
+			flash->diff_programmed++;
+			return qspi_buf_rdwr(flash, kbuf + start, off + start, end - start, true);
+		default:
+			break;
+		}
+	}
+
+	flash->diff_erased++;
+	ret = qspi_page_erase(flash, off, len);
+	if (ret == 0)
+		ret = qspi_buf_rdwr(flash, kbuf, off, len, true);
+	return ret;
+}
+
 /*
  * Write a page. Perform read-modify-write as needed.
- * @cnt contains actual bytes copied from user on successful return.
+ * @cnt contains actual bytes taken from src on successful return.
  */
 static int qspi_page_rmw(struct xrt_qspi *flash,
-			 const char __user *ubuf, u8 *kbuf, loff_t off, size_t *cnt)
+			 const u8 *src, u8 *kbuf, loff_t off, size_t *cnt)
 {
 	loff_t thisoff = QSPI_PAGE_ALIGN(off);
 	size_t front = QSPI_PAGE_OFFSET(off);
@@ -905,28 +1315,34 @@ static int qspi_page_rmw(struct xrt_qspi *flash,
 	u8 *thiskbuf = kbuf;
 	int ret;
 
-	if (front) {
+	/*
+	 * In differential mode, the whole page is needed for comparison anyway,
+	 * so read it once and take front and last part from it.
+	 */
+	if (flash->diff_write) {
+		ret = qspi_buf_rdwr(flash, flash->diff_buf, thisoff, QSPI_PAGE_SIZE, false);
+		if (ret)
+			return ret;
+		memcpy(kbuf, flash->diff_buf, QSPI_PAGE_SIZE);
+	} else if (front) {
 		ret = qspi_buf_rdwr(flash, thiskbuf, thisoff, front, false);
 		if (ret)
 			return ret;
 	}
 	thisoff += front;
 	thiskbuf += front;
-	if (copy_from_user(thiskbuf, ubuf, mid) != 0)
-		return -EFAULT;
+	memcpy(thiskbuf, src, mid);
 	*cnt = mid;
 	thisoff += mid;
 	thiskbuf += mid;
-	if (last) {
+	if (last && !flash->diff_write) {
 		ret = qspi_buf_rdwr(flash, thiskbuf, thisoff, last, false);
 		if (ret)
 			return ret;
 	}
 
-	ret = qspi_page_erase(flash, QSPI_PAGE_ALIGN(off), QSPI_PAGE_SIZE);
-	if (ret == 0)
-		ret = qspi_buf_rdwr(flash, kbuf, QSPI_PAGE_ALIGN(off), QSPI_PAGE_SIZE, true);
-	return ret;
+	return qspi_page_update(flash, kbuf, QSPI_PAGE_ALIGN(off), QSPI_PAGE_SIZE,
+				flash->diff_write);
 }
 
 static inline size_t qspi_get_page_io_size(loff_t off, size_t sz)
@@ -943,39 +1359,69 @@ static inline size_t qspi_get_page_io_size(loff_t off, size_t sz)
 
 /*
  * Try to erase and write full (large/huge) page.
- * @cnt contains actual bytes copied from user on successful return.
+ * @cnt contains actual bytes taken from src on successful return.
  * Needs to fallback to RMW, if not possible.
  */
 static int qspi_page_wr(struct xrt_qspi *flash,
-			const char __user *ubuf, u8 *kbuf, loff_t off, size_t *cnt)
+			const u8 *src, u8 *kbuf, loff_t off, size_t *cnt)
 {
-	int ret;
 	size_t thislen = qspi_get_page_io_size(off, *cnt);
 
 	if (thislen == 0)
 		return -EOPNOTSUPP;
 
 	*cnt = thislen;
+	memcpy(kbuf, src, thislen);
 
-	if (copy_from_user(kbuf, ubuf, thislen) != 0)
-		return -EFAULT;
+	return qspi_page_update(flash, kbuf, off, thislen, false);
+}
 
-	ret = qspi_page_erase(flash, off, thislen);
-	if (ret == 0)
-		ret = qspi_buf_rdwr(flash, kbuf, off, thislen, true);
+/*
+ * Write to flash memory page by page from kernel buf. Caller should hold
+ * io_lock. @page is a buffer of QSPI_HUGE_PAGE_SIZE bytes.
+ */
+static int qspi_do_write(struct xrt_qspi *flash, const u8 *buf, u8 *page, size_t n, loff_t off)
+{
+	size_t cnt = 0;
+	int ret = 0;
+	struct qspi_flash_addr faddr;
+
+	qspi_offset2faddr(off, &faddr);
+	flash->qspi_curr_slave = faddr.slave;
+
+	if (!qspi_wait_until_ready(flash))
+		ret = -EINVAL;
+	while (ret == 0 && cnt < n) {
+		loff_t thisoff = off + cnt;
+		const u8 *thisbuf = buf + cnt;
+		size_t thislen = n - cnt;
+
+		/* Try write full page. */
+		ret = qspi_page_wr(flash, thisbuf, page, thisoff, &thislen);
+		if (ret) {
+			/* Fallback to RMW. */
+			if (ret == -EOPNOTSUPP)
+				ret = qspi_page_rmw(flash, thisbuf, page, thisoff, &thislen);
+			if (ret)
+				break;
+		}
+		cnt += thislen;
+	}
 	return ret;
 }
 
 /*
- * Write to flash memory page by page from user buf.
+ * Write to flash memory page by page from user buf. User buf is copied in
+ * one erase unit at a time w/o holding io_lock, since it could be mmap'ed
+ * flash and faulting it in needs io_lock.
  */
 static ssize_t qspi_write(struct file *file, const char __user *buf, size_t n, loff_t *off)
 {
 	struct xrt_qspi *flash = file->private_data;
 	u8 *page = NULL;
+	u8 *data = NULL;
 	size_t cnt = 0;
 	int ret = 0;
-	struct qspi_flash_addr faddr;
 
 	QSPI_INFO(flash, "writing %zu bytes @0x%llx", n, *off);
 
@@ -985,36 +1431,37 @@ static ssize_t qspi_write(struct file *file, const char __user *buf, size_t n, l
 	}
 	n = min(n, flash->flash_size - (size_t)*off);
 
-	page = vmalloc(QSPI_HUGE_PAGE_SIZE);
-	if (!page)
-		return -ENOMEM;
-
-	mutex_lock(&flash->io_lock);
+	ret = qspi_sync_write_begin(flash);
+	if (ret)
+		return ret;
 
-	qspi_offset2faddr(*off, &faddr);
-	flash->qspi_curr_slave = faddr.slave;
+	page = vmalloc(QSPI_HUGE_PAGE_SIZE);
+	data = vmalloc(QSPI_HUGE_PAGE_SIZE);
+	if (!page || !data) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	if (!qspi_wait_until_ready(flash))
-		ret = -EINVAL;
 	while (ret == 0 && cnt < n) {
 		loff_t thisoff = *off + cnt;
-		const char *thisbuf = buf + cnt;
-		size_t thislen = n - cnt;
+		size_t unitoff = thisoff & (QSPI_HUGE_PAGE_SIZE - 1);
+		size_t thislen = min(n - cnt, QSPI_HUGE_PAGE_SIZE - unitoff);
 
-		/* Try write full page. */
-		ret = qspi_page_wr(flash, thisbuf, page, thisoff, &thislen);
-		if (ret) {
-			/* Fallback to RMW. */
-			if (ret == -EOPNOTSUPP)
-				ret = qspi_page_rmw(flash, thisbuf, page, thisoff, &thislen);
-			if (ret)
-				break;
+		if (copy_from_user(data, buf + cnt, thislen) != 0) {
+			ret = -EFAULT;
+			break;
 		}
+
+		mutex_lock(&flash->io_lock);
+		ret = qspi_do_write(flash, data, page, thislen, thisoff);
+		mutex_unlock(&flash->io_lock);
 		cnt += thislen;
 	}
-	mutex_unlock(&flash->io_lock);
 
+out:
+	vfree(data);
 	vfree(page);
+	qspi_sync_write_end(flash);
 	if (ret)
 		return ret;
 
@@ -1022,6 +1469,497 @@ static ssize_t qspi_write(struct file *file, const char __user *buf, size_t n, l
 	return n;
 }
 
+/* Time to sleep when all flash devices are busy. */
+#define QSPI_JOB_POLL_US	20
+
+static inline void qspi_job_progress(struct qspi_job *job, u64 *cnt, size_t len)
+{
+	spin_lock(&job->lock);
+	*cnt += len;
+	spin_unlock(&job->lock);
+}
+
+static inline bool qspi_job_img_pending(struct qspi_job_img *img)
+{
+	return img->in_unit || img->done < img->size;
+}
+
+/*
+ * Work out the unit starting @done bytes into the image: its flash offset and
+ * length, where image data starts in it and how many bytes of the image it has.
+ */
+static void qspi_job_unit_geometry(struct qspi_job_img *img, size_t done, loff_t *off,
+				   size_t *len, size_t *front, size_t *datalen)
+{
+	size_t left = img->size - done;
+
+	*off = img->off + done;
+	*len = qspi_get_page_io_size(*off, left);
+	*front = 0;
+	if (*len == 0) {
+		*front = QSPI_PAGE_OFFSET(*off);
+		*off = QSPI_PAGE_ALIGN(*off);
+		*len = QSPI_PAGE_SIZE;
+		*datalen = min(left, *len - *front);
+	} else {
+		*datalen = *len;
+	}
+}
+
+/*
+ * Read image data of the next unit ahead from file. Called w/o holding io_lock,
+ * so that a slow file does not hold others back from flash.
+ */
+static int qspi_job_img_prefetch(struct xrt_qspi *flash, struct qspi_job_img *img)
+{
+	size_t next = img->done + (img->in_unit ? img->unit_data : 0);
+	size_t len, front, datalen;
+	loff_t off;
+	ssize_t n;
+
+	if (!img->file || img->pre_len || next >= img->size)
+		return 0;
+
+	qspi_job_unit_geometry(img, next, &off, &len, &front, &datalen);
+	n = kernel_read(img->file, img->pre, datalen, &img->pos);
+	if (n == (ssize_t)datalen) {
+		img->pre_len = datalen;
+		return 0;
+	}
+	QSPI_ERR(flash, "job: failed to read image @0x%llx: %zd", img->pos, n);
+	return n < 0 ? n : -EIO;
+}
+
+static int qspi_job_img_read(struct qspi_job_img *img, u8 *buf, size_t len)
+{
+	if (!img->file) {
+		memcpy(buf, img->image + img->done, len);
+		return 0;
+	}
+
+	if (WARN_ON(img->pre_len != len))
+		return -EIO;
+	memcpy(buf, img->pre, len);
+	img->pre_len = 0;
+	return 0;
+}
+
+/*
+ * Load next erase unit of the image, compare it with flash content and start
+ * erasing it if needed. Partial page at either end is merged with flash
+ * content, like RMW.
+ */
+static int qspi_job_unit_start(struct xrt_qspi *flash, struct qspi_job *job,
+			       struct qspi_job_img *img)
+{
+	enum qspi_diff_result diff = QSPI_DIFF_ERASE;
+	size_t len, front, datalen, start = 0, end;
+	loff_t off;
+	int ret;
+
+	qspi_job_unit_geometry(img, img->done, &off, &len, &front, &datalen);
+	end = len;
+
+	if (flash->diff_write || datalen != len) {
+		ret = qspi_unit_rd(flash, img->old, off, len);
+		if (ret)
+			return ret;
+		if (datalen != len)
+			memcpy(img->buf, img->old, len);
+	}
+	ret = qspi_job_img_read(img, img->buf + front, datalen);
+	if (ret)
+		return ret;
+
+	if (flash->diff_write)
+		diff = qspi_page_diff(img->old, img->buf, len, &start, &end);
+
+	switch (diff) {
+	case QSPI_DIFF_SAME:
+		flash->diff_skipped++;
+		qspi_job_progress(job, &job->erased, datalen);
+		qspi_job_progress(job, &job->programmed, datalen);
+		img->done += datalen;
+		return 0;
+	case QSPI_DIFF_PROGRAM:
+		flash->diff_programmed++;
+		qspi_job_progress(job, &job->erased, datalen);
+		break;
+	default:
+		flash->diff_erased++;
+		ret = qspi_page_erase_start(flash, off, len);
+		if (ret)
+			return ret;
+		img->busy = true;
+		img->erasing = true;
+		break;
+	}
+
+	img->in_unit = true;
+	img->unit_off = off;
+	img->unit_len = len;
+	img->unit_data = datalen;
+	img->prog_pos = start;
+	img->prog_end = end;
+	return 0;
+}
+
+static int qspi_job_unit_done(struct xrt_qspi *flash, struct qspi_job *job,
+			      struct qspi_job_img *img)
+{
+	int ret;
+
+	if (job->flags & XRT_FLASH_JOB_VERIFY) {
+		ret = qspi_unit_rd(flash, img->vbuf, img->unit_off, img->unit_len);
+		if (ret)
+			return ret;
+		if (memcmp(img->vbuf, img->buf, img->unit_len)) {
+			QSPI_ERR(flash, "job: verify failed @0x%llx", img->unit_off);
+			return -EIO;
+		}
+		qspi_job_progress(job, &job->verified, img->unit_data);
+	}
+
+	qspi_job_progress(job, &job->programmed, img->unit_data);
+	img->done += img->unit_data;
+	img->in_unit = false;
+	return 0;
+}
+
+/*
+ * Move the image forward by one step, if its flash device is ready. Caller
+ * should hold io_lock. Returns -EBUSY, if flash device is still busy.
+ */
+static int qspi_job_step(struct xrt_qspi *flash, struct qspi_job *job, struct qspi_job_img *img)
+{
+	size_t cnt;
+	int ret;
+
+	flash->qspi_curr_slave = img->slave;
+
+	if (img->busy) {
+		if (!qspi_is_ready(flash))
+			return -EBUSY;
+		img->busy = false;
+		if (img->erasing) {
+			img->erasing = false;
+			qspi_job_progress(job, &job->erased, img->unit_data);
+		}
+	}
+
+	if (!img->in_unit)
+		return qspi_job_unit_start(flash, job, img);
+
+	if (img->prog_pos == img->prog_end)
+		return qspi_job_unit_done(flash, job, img);
+
+	cnt = img->prog_end - img->prog_pos;
+	ret = qspi_fifo_wr_start(flash, img->unit_off + img->prog_pos,
+				 img->buf + img->prog_pos, &cnt);
+	if (ret)
+		return ret;
+	img->prog_pos += cnt;
+	img->busy = true;
+	return 0;
+}
+
+static void qspi_job_img_fini(struct qspi_job_img *img)
+{
+	if (img->file)
+		fput(img->file);
+	vfree(img->image);
+	vfree(img->pre);
+	vfree(img->buf);
+	vfree(img->old);
+	vfree(img->vbuf);
+	memset(img, 0, sizeof(*img));
+}
+
+/*
+ * Release resources held by the job and report the result. Resources must be
+ * released before the state is changed, since a new job can be submitted
+ * right after.
+ */
+static void qspi_job_finish(struct xrt_qspi *flash, int err)
+{
+	struct qspi_job *job = &flash->job;
+	u32 state;
+	int i;
+
+	for (i = 0; i < XRT_FLASH_JOB_MAX_IMAGES; i++)
+		qspi_job_img_fini(&job->images[i]);
+
+	if (err == -ECANCELED)
+		state = XRT_FLASH_JOB_CANCELLED;
+	else if (err)
+		state = XRT_FLASH_JOB_FAILED;
+	else
+		state = XRT_FLASH_JOB_DONE;
+
+	spin_lock(&job->lock);
+	job->state = state;
+	job->err = err;
+	job->end = ktime_get();
+	spin_unlock(&job->lock);
+	wake_up_interruptible(&job->wq);
+}
+
+/*
+ * Flash job runs on system_long_wq. All images are moved forward in turn, one
+ * step at a time, so that flash devices work in parallel. io_lock is only held
+ * for one round of steps, so that others can still read flash in between.
+ * Image files are only read from in between rounds, w/o holding io_lock.
+ * Cancel stops the job at the next erase unit: units being updated are always
+ * finished, so that flash is not left erased, but no new unit is started.
+ */
+static void qspi_job_worker(struct work_struct *work)
+{
+	struct xrt_qspi *flash = container_of(work, struct xrt_qspi, job.work);
+	struct qspi_job *job = &flash->job;
+	bool pending = true;
+	int ret = 0;
+	int i;
+
+	QSPI_INFO(flash, "job: programming %zu bytes in %u image(s)", job->size, job->num_images);
+
+	while (ret == 0 && pending) {
+		bool cancel = READ_ONCE(job->cancel);
+		bool progress = false;
+		bool in_unit = false;
+		bool left = false;
+
+		for (i = 0; i < job->num_images; i++) {
+			in_unit |= job->images[i].in_unit;
+			left |= qspi_job_img_pending(&job->images[i]);
+		}
+		if (!left)
+			break;
+		if (cancel && !in_unit) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		for (i = 0; !cancel && ret == 0 && i < job->num_images; i++)
+			ret = qspi_job_img_prefetch(flash, &job->images[i]);
+		if (ret)
+			break;
+
+		pending = false;
+		mutex_lock(&flash->io_lock);
+		for (i = 0; ret == 0 && i < job->num_images; i++) {
+			struct qspi_job_img *img = &job->images[i];
+
+			if (!qspi_job_img_pending(img) || (cancel && !img->in_unit))
+				continue;
+			pending = true;
+			ret = qspi_job_step(flash, job, img);
+			if (ret == 0)
+				progress = true;
+			else if (ret == -EBUSY)
+				ret = 0;
+		}
+		mutex_unlock(&flash->io_lock);
+
+		if (pending && !progress)
+			usleep_range(QSPI_JOB_POLL_US, 2 * QSPI_JOB_POLL_US);
+		else
+			cond_resched();
+	}
+
+	/* Do not leave any flash device in the middle of erase or program. */
+	mutex_lock(&flash->io_lock);
+	for (i = 0; i < job->num_images; i++) {
+		if (!job->images[i].busy)
+			continue;
+		flash->qspi_curr_slave = job->images[i].slave;
+		qspi_wait_until_ready(flash);
+	}
+	mutex_unlock(&flash->io_lock);
+
+	QSPI_INFO(flash, "job: finished with %d", ret);
+	qspi_job_finish(flash, ret);
+}
+
+static int qspi_job_img_init(struct xrt_qspi *flash, struct qspi_job_img *img,
+			     struct xrt_flash_ioc_image *req, u32 flags)
+{
+	struct qspi_flash_addr faddr;
+
+	if (req->xfi_reserved)
+		return -EINVAL;
+	if (req->xfi_size == 0 || !is_valid_offset(flash, req->xfi_offset))
+		return -ENOSPC;
+	qspi_offset2faddr(req->xfi_offset, &faddr);
+	if (faddr.slave >= MAX_NUM_OF_SLAVES)
+		return -ENOSPC;
+	img->slave = faddr.slave;
+	faddr.slave = 0;
+	if (req->xfi_size > flash->flash_size - qspi_faddr2offset(&faddr))
+		return -ENOSPC;
+
+	img->off = req->xfi_offset;
+	img->size = req->xfi_size;
+	img->buf = vmalloc(QSPI_HUGE_PAGE_SIZE);
+	img->old = vmalloc(QSPI_HUGE_PAGE_SIZE);
+	if (!img->buf || !img->old)
+		return -ENOMEM;
+	if (flags & XRT_FLASH_JOB_VERIFY) {
+		img->vbuf = vmalloc(QSPI_HUGE_PAGE_SIZE);
+		if (!img->vbuf)
+			return -ENOMEM;
+	}
+
+	if (req->xfi_fd >= 0) {
+		img->file = fget(req->xfi_fd);
+		if (!img->file)
+			return -EBADF;
+		/* Find out now, not after flash has been changed. */
+		if (!(img->file->f_mode & FMODE_READ))
+			return -EBADF;
+		img->pre = vmalloc(QSPI_HUGE_PAGE_SIZE);
+		if (!img->pre)
+			return -ENOMEM;
+		return 0;
+	}
+
+	img->image = vmalloc(img->size);
+	if (!img->image)
+		return -ENOMEM;
+	if (copy_from_user(img->image, u64_to_user_ptr(req->xfi_buf), img->size))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Images are set up before the job slot is claimed, so that a rejected job
+ * leaves the result of the last one alone.
+ */
+static int qspi_job_submit(struct xrt_qspi *flash, const void __user *arg)
+{
+	struct qspi_job_img imgs[XRT_FLASH_JOB_MAX_IMAGES] = { 0 };
+	struct qspi_job *job = &flash->job;
+	struct xrt_flash_ioc_job req;
+	size_t size = 0;
+	int ret = 0;
+	int i;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.xfj_flags & ~XRT_FLASH_JOB_VERIFY)
+		return -EINVAL;
+	if (req.xfj_num_images == 0 || req.xfj_num_images > XRT_FLASH_JOB_MAX_IMAGES)
+		return -EINVAL;
+	for (i = 0; i < req.xfj_num_images; i++)
+		size += req.xfj_images[i].xfi_size;
+
+	for (i = 0; ret == 0 && i < req.xfj_num_images; i++) {
+		ret = qspi_job_img_init(flash, &imgs[i], &req.xfj_images[i], req.xfj_flags);
+		/* Images on the same flash device can't be done in parallel. */
+		if (ret == 0 && i > 0 && imgs[i].slave == imgs[0].slave)
+			ret = -EINVAL;
+	}
+	if (ret)
+		goto fail;
+
+	/* Claim the job slot, so that no one else can submit or write(). */
+	spin_lock(&job->lock);
+	if (job->state == XRT_FLASH_JOB_RUNNING || job->sync_writers) {
+		spin_unlock(&job->lock);
+		ret = -EBUSY;
+		goto fail;
+	}
+	job->state = XRT_FLASH_JOB_RUNNING;
+	job->err = 0;
+	job->size = size;
+	job->erased = 0;
+	job->programmed = 0;
+	job->verified = 0;
+	job->start = ktime_get();
+	spin_unlock(&job->lock);
+
+	job->num_images = req.xfj_num_images;
+	job->flags = req.xfj_flags;
+	job->cancel = false;
+	memcpy(job->images, imgs, sizeof(imgs));
+	queue_work(system_long_wq, &job->work);
+	return 0;
+
+fail:
+	for (i = 0; i < XRT_FLASH_JOB_MAX_IMAGES; i++)
+		qspi_job_img_fini(&imgs[i]);
+	return ret;
+}
+
+static void qspi_job_cancel(struct xrt_qspi *flash, bool wait)
+{
+	WRITE_ONCE(flash->job.cancel, true);
+	if (wait)
+		flush_work(&flash->job.work);
+}
+
+static void qspi_job_get_status(struct xrt_qspi *flash, struct xrt_flash_ioc_job_status *st)
+{
+	struct qspi_job *job = &flash->job;
+	ktime_t end;
+
+	spin_lock(&job->lock);
+	st->xfjs_state = job->state;
+	st->xfjs_error = job->err;
+	st->xfjs_size = job->size;
+	/* Erase is done in units, which may go beyond the image. */
+	st->xfjs_erased = min_t(u64, job->erased, job->size);
+	st->xfjs_programmed = min_t(u64, job->programmed, job->size);
+	st->xfjs_verified = job->verified;
+	end = job->state == XRT_FLASH_JOB_RUNNING ? ktime_get() : job->end;
+	st->xfjs_elapsed_ms = job->state == XRT_FLASH_JOB_IDLE ? 0 :
+		ktime_ms_delta(end, job->start);
+	spin_unlock(&job->lock);
+}
+
+static long qspi_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct xrt_qspi *flash = file->private_data;
+	struct xrt_flash_ioc_job_status st;
+	long ret = 0;
+
+	if (_IOC_TYPE(cmd) != XRT_FLASH_IOC_MAGIC)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case XRT_FLASH_IOC_JOB_SUBMIT:
+		ret = qspi_job_submit(flash, (const void __user *)arg);
+		break;
+	case XRT_FLASH_IOC_JOB_STATUS:
+		qspi_job_get_status(flash, &st);
+		if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+			ret = -EFAULT;
+		break;
+	case XRT_FLASH_IOC_JOB_CANCEL:
+		qspi_job_cancel(flash, false);
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+	return ret;
+}
+
+/* Readable once the last submitted job is finished. */
+static __poll_t qspi_poll(struct file *file, poll_table *wait)
+{
+	struct xrt_qspi *flash = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &flash->job.wq, wait);
+
+	spin_lock(&flash->job.lock);
+	if (flash->job.state != XRT_FLASH_JOB_IDLE && flash->job.state != XRT_FLASH_JOB_RUNNING)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	spin_unlock(&flash->job.lock);
+	return mask;
+}
+
 static loff_t qspi_llseek(struct file *filp, loff_t off, int whence)
 {
 	loff_t npos;
@@ -1045,6 +1983,61 @@ static loff_t qspi_llseek(struct file *filp, loff_t off, int whence)
 	return npos;
 }
 
+static vm_fault_t qspi_vm_fault(struct vm_fault *vmf)
+{
+	struct xrt_qspi *flash = vmf->vma->vm_private_data;
+	struct page *page;
+	int ret;
+
+	mutex_lock(&flash->io_lock);
+	ret = qspi_cache_get(flash, (loff_t)vmf->pgoff << PAGE_SHIFT, &page);
+	if (ret == 0)
+		get_page(page);
+	mutex_unlock(&flash->io_lock);
+
+	if (ret == -ENOMEM)
+		return VM_FAULT_OOM;
+	if (ret)
+		return VM_FAULT_SIGBUS;
+	vmf->page = page;
+	return 0;
+}
+
+static const struct vm_operations_struct qspi_vm_ops = {
+	.fault = qspi_vm_fault,
+};
+
+/*
+ * Read-only view of flash, file offset is flash offset as in read(). Pages are
+ * faulted in through page cache and zapped when flash content changes.
+ */
+static int qspi_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct xrt_qspi *flash = file->private_data;
+	loff_t off = (loff_t)vma->vm_pgoff << PAGE_SHIFT;
+	int ret = 0;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (!is_valid_range(flash, off, vma->vm_end - vma->vm_start))
+		return -EINVAL;
+
+	mutex_lock(&flash->io_lock);
+	if (flash->cache_max)
+		flash->cache_mapping = file->f_mapping;
+	else
+		ret = -EOPNOTSUPP;
+	mutex_unlock(&flash->io_lock);
+	if (ret)
+		return ret;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &qspi_vm_ops;
+	vma->vm_private_data = flash;
+	return 0;
+}
+
 /*
  * Only allow one client at a time.
  */
@@ -1068,6 +2061,14 @@ static int qspi_close(struct inode *inode, struct file *file)
 	if (!flash)
 		return -EINVAL;
 
+	/* Job does not outlive its submitter. */
+	qspi_job_cancel(flash, true);
+
+	/* All mappings are gone by now. */
+	mutex_lock(&flash->io_lock);
+	flash->cache_mapping = NULL;
+	mutex_unlock(&flash->io_lock);
+
 	file->private_data = NULL;
 	xleaf_devnode_close(inode);
 	return 0;
@@ -1088,9 +2089,123 @@ static ssize_t size_show(struct device *dev, struct device_attribute *attr, char
 }
 static DEVICE_ATTR_RO(size);
 
+/*
+ * Differential write on/off. When on, erase units with identical content are
+ * skipped and those only needing bits cleared are programmed without erase.
+ */
+static ssize_t diff_write_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct xrt_qspi *flash = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", flash->diff_write);
+}
+
+static ssize_t diff_write_store(struct device *dev, struct device_attribute *da,
+				const char *buf, size_t count)
+{
+	struct xrt_qspi *flash = dev_get_drvdata(dev);
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	mutex_lock(&flash->io_lock);
+	flash->diff_write = val;
+	mutex_unlock(&flash->io_lock);
+	return count;
+}
+static DEVICE_ATTR_RW(diff_write);
+
+/*
+ * Number of erase units skipped, programmed only and erased by writes, and
+ * bytes of all ones not programmed.
+ */
+static ssize_t write_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct xrt_qspi *flash = dev_get_drvdata(dev);
+	ssize_t cnt;
+
+	mutex_lock(&flash->io_lock);
+	cnt = sprintf(buf, "skipped %llu\nprogrammed %llu\nerased %llu\nff_skipped %llu\n",
+		      flash->diff_skipped, flash->diff_programmed, flash->diff_erased,
+		      flash->ff_skipped);
+	mutex_unlock(&flash->io_lock);
+	return cnt;
+}
+static DEVICE_ATTR_RO(write_stats);
+
+/* State and progress of the last flash job. */
+static ssize_t flash_job_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	static const char * const state_names[] = {
+		"idle", "running", "done", "failed", "cancelled",
+	};
+	struct xrt_qspi *flash = dev_get_drvdata(dev);
+	struct xrt_flash_ioc_job_status st;
+
+	qspi_job_get_status(flash, &st);
+	return sprintf(buf, "state %s\nerror %d\nsize %llu\nerased %llu\n"
+		       "programmed %llu\nverified %llu\nelapsed_ms %llu\n",
+		       state_names[st.xfjs_state], st.xfjs_error, st.xfjs_size,
+		       st.xfjs_erased, st.xfjs_programmed, st.xfjs_verified,
+		       st.xfjs_elapsed_ms);
+}
+static DEVICE_ATTR_RO(flash_job);
+
+/* Size limit of flash page cache in MB, 0 disables and drops the cache. */
+static ssize_t cache_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct xrt_qspi *flash = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%zu\n", flash->cache_max >> (20 - PAGE_SHIFT));
+}
+
+static ssize_t cache_size_store(struct device *dev, struct device_attribute *da,
+				const char *buf, size_t count)
+{
+	struct xrt_qspi *flash = dev_get_drvdata(dev);
+	u32 val;
+	int ret = 0;
+
+	if (kstrtou32(buf, 0, &val))
+		return -EINVAL;
+
+	mutex_lock(&flash->io_lock);
+	if (val == 0 && flash->cache_mapping) {
+		ret = -EBUSY;
+	} else {
+		flash->cache_max = min_t(size_t, (size_t)val << (20 - PAGE_SHIFT),
+					 flash->cache_entries);
+		while (flash->cache_used > flash->cache_max)
+			qspi_cache_evict(flash);
+	}
+	mutex_unlock(&flash->io_lock);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(cache_size);
+
+static ssize_t cache_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct xrt_qspi *flash = dev_get_drvdata(dev);
+	ssize_t cnt;
+
+	mutex_lock(&flash->io_lock);
+	cnt = sprintf(buf, "used_kb %zu\nhits %llu\nmisses %llu\n",
+		      flash->cache_used << (PAGE_SHIFT - 10), flash->cache_hits,
+		      flash->cache_misses);
+	mutex_unlock(&flash->io_lock);
+	return cnt;
+}
+static DEVICE_ATTR_RO(cache_stats);
+
 static struct attribute *qspi_attrs[] = {
 	&dev_attr_flash_type.attr,
 	&dev_attr_size.attr,
+	&dev_attr_diff_write.attr,
+	&dev_attr_write_stats.attr,
+	&dev_attr_flash_job.attr,
+	&dev_attr_cache_size.attr,
+	&dev_attr_cache_stats.attr,
 	NULL,
 };
 
@@ -1107,9 +2222,21 @@ static int qspi_remove(struct platform_device *pdev)
 	platform_set_drvdata(pdev, NULL);
 
 	sysfs_remove_group(&DEV(flash->pdev)->kobj, &qspi_attr_group);
+	qspi_job_cancel(flash, true);
 
 	if (flash->io_buf)
 		vfree(flash->io_buf);
+	if (flash->diff_buf)
+		vfree(flash->diff_buf);
+	if (flash->cache) {
+		size_t i;
+
+		for (i = 0; i < flash->cache_entries; i++) {
+			if (flash->cache[i])
+				put_page(flash->cache[i]);
+		}
+		vfree(flash->cache);
+	}
 
 	if (flash->qspi_regs)
 		iounmap(flash->qspi_regs);
@@ -1182,7 +2309,8 @@ static int qspi_controller_probe(struct xrt_qspi *flash)
 	if (ret)
 		return ret;
 
-	flash->qspi_curr_sector = 0xff;
+	/* Sector (extended address) register is per flash device. */
+	memset(flash->qspi_curr_sector, 0xff, sizeof(flash->qspi_curr_sector));
 
 	return 0;
 }
@@ -1200,6 +2328,9 @@ static int qspi_probe(struct platform_device *pdev)
 	flash->pdev = pdev;
 
 	mutex_init(&flash->io_lock);
+	INIT_WORK(&flash->job.work, qspi_job_worker);
+	spin_lock_init(&flash->job.lock);
+	init_waitqueue_head(&flash->job.wq);
 
 	flash->res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	if (!flash->res) {
@@ -1225,6 +2356,23 @@ static int qspi_probe(struct platform_device *pdev)
 		goto error;
 	}
 
+	/* Big enough to hold the largest erase unit. */
+	flash->diff_buf = vmalloc(QSPI_HUGE_PAGE_SIZE);
+	if (!flash->diff_buf) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	flash->diff_write = true;
+
+	flash->cache_entries = MAX_NUM_OF_SLAVES * (flash->flash_size >> PAGE_SHIFT);
+	flash->cache = vzalloc(array_size(flash->cache_entries, sizeof(*flash->cache)));
+	if (!flash->cache) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	flash->cache_max = min_t(size_t, QSPI_CACHE_DEFAULT_MB << (20 - PAGE_SHIFT),
+				 flash->cache_entries);
+
 	ret  = sysfs_create_group(&DEV(pdev)->kobj, &qspi_attr_group);
 	if (ret)
 		QSPI_ERR(flash, "failed to create sysfs nodes");
@@ -1298,6 +2446,9 @@ static struct xrt_subdev_drvdata qspi_data = {
 			.read = qspi_read,
 			.write = qspi_write,
 			.llseek = qspi_llseek,
+			.unlocked_ioctl = qspi_ioctl,
+			.poll = qspi_poll,
+			.mmap = qspi_mmap,
 		},
 		.xsf_dev_name = "flash",
 	},
@@ -390,6 +390,17 @@ static int xroot_root_cb(struct device *dev, void *parg, enum xrt_root_cmd cmd,
 		id->xpigi_sub_device_id = xr->pdev->subsystem_device;
 		break;
 	}
+	case XRT_ROOT_GET_IRQ: {
+		struct xrt_root_get_irq *irq =
+			(struct xrt_root_get_irq *)arg;
+
+		rc = pci_irq_vector(xr->pdev, irq->xpigq_vector);
+		if (rc >= 0) {
+			irq->xpigq_irq = rc;
+			rc = 0;
+		}
+		break;
+	}
 
 	/* MISC generic PCIE driver functions. */
 	case XRT_ROOT_HOT_RESET: {
@@ -543,6 +554,7 @@ int xroot_probe(struct pci_dev *pdev, struct xroot_pf_cb *cb, void **root)
 {
 	struct device *dev = DEV(pdev);
 	struct xroot *xr = NULL;
+	int nvec;
 
 	dev_info(dev, "%s: probing...", __func__);
 
@@ -555,6 +567,17 @@ int xroot_probe(struct pci_dev *pdev, struct xroot_pf_cb *cb, void **root)
 	xroot_grps_init(xr);
 	xroot_event_init(xr);
 
+	/*
+	 * Interrupts are optional. Leaves fall back to polling mode when the
+	 * vector they are wired to in metadata is not available.
+	 */
+	nvec = pci_msix_vec_count(pdev);
+	if (nvec > 0) {
+		nvec = pci_alloc_irq_vectors(pdev, 1, nvec, PCI_IRQ_MSIX);
+		if (nvec < 0)
+			xroot_warn(xr, "failed to alloc MSI-X vectors: %d", nvec);
+	}
+
 	*root = xr;
 	return 0;
 }
@@ -576,6 +599,7 @@ void xroot_remove(void *root)
 
 	xroot_event_fini(xr);
 	xroot_grps_fini(xr);
+	pci_free_irq_vectors(xr->pdev);
 }
 EXPORT_SYMBOL_GPL(xroot_remove);
 
@@ -11,6 +11,7 @@
  */
 
 #include <linux/crc32c.h>
+#include <linux/workqueue.h>
 #include <linux/xrt/mailbox_proto.h>
 #include "main-impl.h"
 #include "xleaf/mailbox.h"
@@ -21,12 +22,41 @@
 #include "xleaf/calib.h"
 #include "xleaf/icap.h"
 
+/* Max number of read-only queries from peer being processed concurrently. */
+#define XMGMT_MAILBOX_QUERY_WORKERS	4
+/*
+ * Max number of requests queued up or being processed in one lane. Beyond it,
+ * requests are refused right away, listener never blocks on a lane.
+ */
+#define XMGMT_MAILBOX_LANE_MAX_REQS	16
+
 struct xmgmt_mailbox {
 	struct platform_device *pdev;
 	struct platform_device *mailbox;
 	struct mutex lock; /* lock for xmgmt_mailbox */
 	char *test_msg;
 	bool peer_in_same_domain;
+	/*
+	 * Requests from peer are processed in two lanes. Long running ones,
+	 * which may change the state of the device, are processed one at a time
+	 * in the order of being received. Read-only queries are processed
+	 * concurrently, so that they are not blocked behind the former.
+	 */
+	struct workqueue_struct *ordered_wq;
+	struct workqueue_struct *query_wq;
+	atomic_t ordered_inflight;
+	atomic_t query_inflight;
+};
+
+/* Request from peer waiting to be processed in one of the lanes. */
+struct xmgmt_mailbox_work {
+	struct work_struct work;
+	struct xmgmt_mailbox *xmbx;
+	atomic_t *inflight;
+	u64 msgid;
+	bool sw_ch;
+	size_t len;
+	char data[];
 };
 
 static inline const char *mailbox_chan2name(bool sw_ch)
@@ -109,6 +139,16 @@ static void xmgmt_mailbox_respond(struct xmgmt_mailbox *xmbx,
 	mutex_unlock(&xmbx->lock);
 }
 
+static void xmgmt_mailbox_set_conn_flags(struct xmgmt_mailbox *xmbx, u64 conn_flags)
+{
+	struct xrt_mailbox_conn conn = { conn_flags };
+
+	mutex_lock(&xmbx->lock);
+	if (xmbx->mailbox)
+		xleaf_call(xmbx->mailbox, XRT_MAILBOX_SET_CONN_FLAGS, &conn);
+	mutex_unlock(&xmbx->lock);
+}
+
 static void xmgmt_mailbox_resp_test_msg(struct xmgmt_mailbox *xmbx, u64 msgid, bool sw_ch)
 {
 	struct platform_device *pdev = xmbx->pdev;
@@ -575,7 +615,7 @@ static void xmgmt_mailbox_resp_user_probe(struct xmgmt_mailbox *xmbx, struct xcl
 	if (!resp)
 		return;
 
-	if (len < (sizeof(*req) + sizeof(*conn) - 1)) {
+	if (len < (sizeof(*req) + offsetofend(struct xcl_mailbox_conn, version) - 1)) {
 		xrt_err(xmbx->pdev, "received corrupted %s, dropped", mailbox_req2name(req->req));
 		vfree(resp);
 		return;
@@ -586,8 +626,16 @@ static void xmgmt_mailbox_resp_user_probe(struct xmgmt_mailbox *xmbx, struct xcl
 		xmbx->peer_in_same_domain = true;
 		resp->conn_flags |= XCL_MB_PEER_SAME_DOMAIN;
 	}
+	/* Old peer does not send conn_flags. */
+	if (len >= sizeof(*req) - 1 + offsetofend(struct xcl_mailbox_conn, conn_flags))
+		resp->conn_flags |= conn->conn_flags &
+			(XCL_MB_PEER_PKT_STREAM | XCL_MB_PEER_BUSY_NACK |
+			 (XRT_MAILBOX_LZ4 ? XCL_MB_PEER_MSG_COMPRESS : 0) |
+			 XCL_MB_PEER_MSG_STRIPE);
 
 	xmgmt_mailbox_respond(xmbx, msgid, sw_ch, resp, sizeof(*resp));
+	/* Response is sent in old format, switch to what's agreed on from now on. */
+	xmgmt_mailbox_set_conn_flags(xmbx, resp->conn_flags);
 	vfree(resp);
 }
 
@@ -617,23 +665,11 @@ static void xmgmt_mailbox_resp_load_xclbin(struct xmgmt_mailbox *xmbx, struct xc
 	xmgmt_mailbox_simple_respond(xmbx, msgid, sw_ch, ret);
 }
 
-static void xmgmt_mailbox_listener(void *arg, void *data, size_t len,
-				   u64 msgid, int err, bool sw_ch)
+static void xmgmt_mailbox_process_request(struct xmgmt_mailbox *xmbx, struct xcl_mailbox_req *req,
+					  size_t len, u64 msgid, bool sw_ch)
 {
-	struct xmgmt_mailbox *xmbx = (struct xmgmt_mailbox *)arg;
 	struct platform_device *pdev = xmbx->pdev;
-	struct xcl_mailbox_req *req = (struct xcl_mailbox_req *)data;
 
-	if (err) {
-		xrt_err(pdev, "failed to receive request: %d", err);
-		return;
-	}
-	if (len < sizeof(*req)) {
-		xrt_err(pdev, "received corrupted request");
-		return;
-	}
-
-	XMGMT_MAILBOX_PRT_REQ_RECV(xmbx, req, sw_ch);
 	switch (req->req) {
 	case XCL_MAILBOX_REQ_TEST_READ:
 		xmgmt_mailbox_resp_test_msg(xmbx, msgid, sw_ch);
@@ -664,6 +700,102 @@ static void xmgmt_mailbox_listener(void *arg, void *data, size_t len,
 	}
 }
 
+static void xmgmt_mailbox_work_fn(struct work_struct *work)
+{
+	struct xmgmt_mailbox_work *w = container_of(work, struct xmgmt_mailbox_work, work);
+
+	xmgmt_mailbox_process_request(w->xmbx, (struct xcl_mailbox_req *)w->data,
+				      w->len, w->msgid, w->sw_ch);
+	atomic_dec(w->inflight);
+	kfree(w);
+}
+
+/*
+ * Pick the lane for the request and return its in-flight counter, or NULL if it
+ * can be processed right away.
+ */
+static struct workqueue_struct *xmgmt_mailbox_req2wq(struct xmgmt_mailbox *xmbx,
+						     struct xcl_mailbox_req *req,
+						     atomic_t **inflight)
+{
+	switch (req->req) {
+	case XCL_MAILBOX_REQ_TEST_READ:
+	case XCL_MAILBOX_REQ_PEER_DATA:
+		*inflight = &xmbx->query_inflight;
+		return xmbx->query_wq;
+	case XCL_MAILBOX_REQ_USER_PROBE:
+	case XCL_MAILBOX_REQ_HOT_RESET:
+	case XCL_MAILBOX_REQ_LOAD_XCLBIN_KADDR:
+		*inflight = &xmbx->ordered_inflight;
+		return xmbx->ordered_wq;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Lane is full, tell peer to retry later. No need to take xmbx->lock, mailbox
+ * can't go away while its listener is running.
+ */
+static void xmgmt_mailbox_refuse(struct xmgmt_mailbox *xmbx, struct xcl_mailbox_req *req,
+				 u64 msgid, bool sw_ch)
+{
+	struct xrt_mailbox_post post = {
+		.xmip_req_id = msgid,
+		.xmip_sw_ch = sw_ch,
+	};
+	int ret;
+
+	ret = xleaf_call(xmbx->mailbox, XRT_MAILBOX_REFUSE, &post);
+	xrt_warn(xmbx->pdev, "too many %s requests in flight, %s",
+		 mailbox_req2name(req->req), ret ? "dropped" : "refused");
+}
+
+static void xmgmt_mailbox_listener(void *arg, void *data, size_t len,
+				   u64 msgid, int err, bool sw_ch)
+{
+	struct xmgmt_mailbox *xmbx = (struct xmgmt_mailbox *)arg;
+	struct platform_device *pdev = xmbx->pdev;
+	struct xcl_mailbox_req *req = (struct xcl_mailbox_req *)data;
+	struct xmgmt_mailbox_work *w = NULL;
+	struct workqueue_struct *wq;
+	atomic_t *inflight = NULL;
+
+	if (err) {
+		xrt_err(pdev, "failed to receive request: %d", err);
+		return;
+	}
+	if (len < sizeof(*req)) {
+		xrt_err(pdev, "received corrupted request");
+		return;
+	}
+
+	XMGMT_MAILBOX_PRT_REQ_RECV(xmbx, req, sw_ch);
+
+	/* Request buffer is gone after we return, make a copy for the lane. */
+	wq = xmgmt_mailbox_req2wq(xmbx, req, &inflight);
+	if (wq && atomic_inc_return(inflight) <= XMGMT_MAILBOX_LANE_MAX_REQS)
+		w = kmalloc(struct_size(w, data, len), GFP_KERNEL);
+	if (wq && !w) {
+		atomic_dec(inflight);
+		xmgmt_mailbox_refuse(xmbx, req, msgid, sw_ch);
+		return;
+	}
+	if (!w) {
+		xmgmt_mailbox_process_request(xmbx, req, len, msgid, sw_ch);
+		return;
+	}
+
+	INIT_WORK(&w->work, xmgmt_mailbox_work_fn);
+	w->xmbx = xmbx;
+	w->inflight = inflight;
+	w->msgid = msgid;
+	w->sw_ch = sw_ch;
+	w->len = len;
+	memcpy(w->data, data, len);
+	queue_work(wq, &w->work);
+}
+
 static void xmgmt_mailbox_reg_listener(struct xmgmt_mailbox *xmbx)
 {
 	struct xrt_mailbox_listen listen = { xmgmt_mailbox_listener, xmbx };
@@ -770,7 +902,7 @@ static int xmgmt_mailbox_get_test_msg(struct xmgmt_mailbox *xmbx, bool sw_ch,
 	struct xcl_mailbox_req req = { 0, XCL_MAILBOX_REQ_TEST_READ, };
 	struct xrt_mailbox_request leaf_req = {
 		.xmir_sw_ch = sw_ch,
-		.xmir_resp_ttl = 1,
+		.xmir_resp_timeout_ms = 1000,
 		.xmir_req = &req,
 		.xmir_req_size = sizeof(req),
 		.xmir_resp = buf,
@@ -847,6 +979,17 @@ static const struct attribute_group xmgmt_mailbox_attrgroup = {
 	.attrs = xmgmt_mailbox_attrs,
 };
 
+static void xmgmt_mailbox_lanes_fini(struct xmgmt_mailbox *xmbx)
+{
+	/* Drain all pending requests. */
+	if (xmbx->ordered_wq)
+		destroy_workqueue(xmbx->ordered_wq);
+	if (xmbx->query_wq)
+		destroy_workqueue(xmbx->query_wq);
+	xmbx->ordered_wq = NULL;
+	xmbx->query_wq = NULL;
+}
+
 void *xmgmt_mailbox_probe(struct platform_device *pdev)
 {
 	struct xmgmt_mailbox *xmbx = devm_kzalloc(DEV(pdev), sizeof(*xmbx), GFP_KERNEL);
@@ -857,9 +1000,17 @@ void *xmgmt_mailbox_probe(struct platform_device *pdev)
 	xmbx->pdev = pdev;
 	mutex_init(&xmbx->lock);
 
+	/* Requests are processed in the listener if lanes are not available. */
+	xmbx->ordered_wq = alloc_ordered_workqueue("%s-mbx", 0, dev_name(DEV(pdev)));
+	xmbx->query_wq = alloc_workqueue("%s-mbx-query", WQ_UNBOUND,
+					 XMGMT_MAILBOX_QUERY_WORKERS, dev_name(DEV(pdev)));
+	if (!xmbx->ordered_wq || !xmbx->query_wq)
+		xrt_warn(pdev, "failed to create request lanes, process serially");
+
 	ret = sysfs_create_group(&DEV(pdev)->kobj, &xmgmt_mailbox_attrgroup);
 	if (ret) {
 		xrt_err(pdev, "create sysfs group failed, ret %d", ret);
+		xmgmt_mailbox_lanes_fini(xmbx);
 		return NULL;
 	}
 
@@ -872,6 +1023,12 @@ void xmgmt_mailbox_remove(void *handle)
 	struct platform_device *pdev = xmbx->pdev;
 
 	sysfs_remove_group(&DEV(pdev)->kobj, &xmgmt_mailbox_attrgroup);
+	/* No more requests can be queued to the lanes once listener is gone. */
+	mutex_lock(&xmbx->lock);
+	if (xmbx->mailbox)
+		xmgmt_mailbox_unreg_listener(xmbx);
+	mutex_unlock(&xmbx->lock);
+	xmgmt_mailbox_lanes_fini(xmbx);
 	if (xmbx->mailbox)
 		xleaf_put_leaf(pdev, xmbx->mailbox);
 	if (xmbx->test_msg)
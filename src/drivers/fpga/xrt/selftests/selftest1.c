@@ -125,18 +125,22 @@ static int selftest1_create_group(struct selftest1 *xm, const char *ep)
  *                          |   selftest1   |
  *                          +-----+-----+
  *                                |
- *           +--------------------+--------------------+
- *           |                    |                    |
- *           v                    v                    v
- *      +--------+           +--------+            +--------+
- *      | group0 |           | group1 |            | group2 |
- *      +----+---+           +----+---+            +---+----+
- *           |                    |                    |
- *           |                    |                    |
- *           v                    v                    v
- *      +---------+          +---------+          +-----------+
- *      | test[0] |          | test[1] |          | mgmt_main |
- *      +---------+          +---------+          +-----------+
+ *           +--------------------+--------------------+--------------------+
+ *           |                    |                    |                    |
+ *           v                    v                    v                    v
+ *      +--------+           +--------+            +--------+           +--------+
+ *      | group0 |           | group1 |            | group2 |           | group3 |
+ *      +----+---+           +----+---+            +---+----+           +----+---+
+ *           |                    |                    |                    |
+ *           |                    |                    |                    |
+ *           v                    v                    v                    v
+ *      +---------+          +---------+          +-----------+       +-----------+
+ *      | test[0] |          | test[1] |          | mgmt_main |       |  mailbox  |
+ *      +---------+          +---------+          +-----------+       | loopback  |
+ *                                                                    +-----------+
+ *
+ * The loopback mailbox has no HW behind it, test leaf uses it to benchmark the
+ * mailbox driver, see mailbox_bench in xleaf/test.c.
  */
 static int selftest1_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
@@ -165,6 +169,11 @@ static int selftest1_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 
 	ret = selftest1_create_group(xm, XRT_MD_NODE_MGMT_MAIN);
 
+	if (ret)
+		goto failed_metadata;
+
+	ret = selftest1_create_group(xm, XRT_MD_NODE_MAILBOX_LOOPBACK);
+
 	if (ret)
 		goto failed_metadata;
 
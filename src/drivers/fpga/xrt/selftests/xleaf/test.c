@@ -11,15 +11,50 @@
 #include <linux/delay.h>
 #include <linux/uuid.h>
 #include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "metadata.h"
 #include "xleaf.h"
+#include "xleaf/mailbox.h"
 #include "test.h"
 
 #define XRT_TEST "xrt_test"
 
+/*
+ * Mailbox benchmark runs against the loopback mailbox. Each point of the sweep
+ * sends the given number of requests of one payload size from a number of
+ * concurrent senders. Listener echos back the request as response.
+ */
+#define XRT_TEST_BENCH_TIMEOUT_MS	5000
+#define XRT_TEST_BENCH_MAX_CNT		100000
+static const size_t xrt_test_bench_sizes[] = { 64, 1024, 4096, 65536 };
+static const u32 xrt_test_bench_concs[] = { 1, 4, 16 };
+/*
+ * Only one listener on the mailbox, so one benchmark at a time. The listener
+ * it replaces is put back when done.
+ */
+static DEFINE_MUTEX(xrt_test_bench_lock);
+
+struct xrt_test_bench {
+	struct platform_device *mbx;
+	size_t size;
+	u32 count;
+	atomic_t next; /* index of next request to send */
+	atomic_t errors;
+	u64 *lat; /* latency of each request in ns, U64_MAX if failed */
+};
+
+struct xrt_test_bench_worker {
+	struct work_struct work;
+	struct xrt_test_bench *bench;
+};
+
 struct xrt_test {
 	struct platform_device *pdev;
 	struct platform_device *leaf;
+	char *bench_result;
 };
 
 static bool xrt_test_leaf_match(enum xrt_subdev_id id,
@@ -59,9 +94,196 @@ static ssize_t release_store(struct device *dev,
 }
 static DEVICE_ATTR_WO(release);
 
+static void xrt_test_bench_listen_cb(void *arg, void *data, size_t len,
+				     u64 msgid, int err, bool sw_ch)
+{
+	struct xrt_test_bench *tb = arg;
+	struct xrt_mailbox_post post = {
+		.xmip_req_id = msgid,
+		.xmip_sw_ch = sw_ch,
+		.xmip_data = data,
+		.xmip_data_size = len,
+	};
+
+	if (err)
+		return;
+	(void)xleaf_call(tb->mbx, XRT_MAILBOX_POST, &post);
+}
+
+static void xrt_test_bench_work(struct work_struct *work)
+{
+	struct xrt_test_bench_worker *w = container_of(work, struct xrt_test_bench_worker, work);
+	struct xrt_test_bench *tb = w->bench;
+	struct xrt_mailbox_request req = { 0 };
+	void *buf;
+	ktime_t start;
+	int i;
+
+	/* Response lands in the same buffer, it is an echo anyway. */
+	buf = kvzalloc(tb->size, GFP_KERNEL);
+	if (!buf) {
+		while ((i = atomic_inc_return(&tb->next) - 1) < tb->count) {
+			atomic_inc(&tb->errors);
+			tb->lat[i] = U64_MAX;
+		}
+		return;
+	}
+
+	while ((i = atomic_inc_return(&tb->next) - 1) < tb->count) {
+		req.xmir_resp_timeout_ms = XRT_TEST_BENCH_TIMEOUT_MS;
+		req.xmir_req = buf;
+		req.xmir_req_size = tb->size;
+		req.xmir_resp = buf;
+		req.xmir_resp_size = tb->size;
+
+		start = ktime_get();
+		if (xleaf_call(tb->mbx, XRT_MAILBOX_REQUEST, &req)) {
+			atomic_inc(&tb->errors);
+			tb->lat[i] = U64_MAX;
+			continue;
+		}
+		tb->lat[i] = ktime_to_ns(ktime_sub(ktime_get(), start));
+	}
+	kvfree(buf);
+}
+
+static int xrt_test_bench_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return x < y ? -1 : (x > y);
+}
+
+/* Run one point of the sweep and print result into buf. */
+static int xrt_test_bench_run(struct xrt_test_bench *tb, u32 conc, char *buf, size_t sz)
+{
+	struct xrt_test_bench_worker *workers;
+	u64 elapsed, rate = 0, p50 = 0, p99 = 0;
+	ktime_t start;
+	u32 ok, i;
+
+	workers = kcalloc(conc, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return -ENOMEM;
+
+	atomic_set(&tb->next, 0);
+	atomic_set(&tb->errors, 0);
+	start = ktime_get();
+	for (i = 0; i < conc; i++) {
+		workers[i].bench = tb;
+		INIT_WORK(&workers[i].work, xrt_test_bench_work);
+		queue_work(system_unbound_wq, &workers[i].work);
+	}
+	for (i = 0; i < conc; i++)
+		flush_work(&workers[i].work);
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+	kfree(workers);
+
+	/* Failed ones are sorted to the end and left out. */
+	sort(tb->lat, tb->count, sizeof(*tb->lat), xrt_test_bench_cmp, NULL);
+	ok = tb->count - atomic_read(&tb->errors);
+	if (ok) {
+		rate = div64_u64((u64)ok * NSEC_PER_SEC, max_t(u64, elapsed, 1));
+		p50 = tb->lat[(ok - 1) * 50 / 100] / NSEC_PER_USEC;
+		p99 = tb->lat[(ok - 1) * 99 / 100] / NSEC_PER_USEC;
+	}
+
+	return scnprintf(buf, sz, "%8zu %5u %8u %10llu %10llu %10llu %8u\n",
+			 tb->size, conc, tb->count, rate, p50, p99, tb->count - ok);
+}
+
+static int xrt_test_bench(struct xrt_test *xt, u32 count)
+{
+	struct platform_device *pdev = xt->pdev;
+	struct xrt_test_bench tb = { 0 };
+	struct xrt_mailbox_listen listen = { 0 };
+	char *buf = xt->bench_result;
+	int i, j, n = 0;
+	int ret = 0;
+
+	tb.mbx = xleaf_get_leaf_by_id(pdev, XRT_SUBDEV_MAILBOX, PLATFORM_DEVID_NONE);
+	if (!tb.mbx)
+		return -ENODEV;
+	tb.count = count;
+	tb.lat = vzalloc(array_size(count, sizeof(*tb.lat)));
+	if (!tb.lat) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	listen.xmil_cb = xrt_test_bench_listen_cb;
+	listen.xmil_cb_arg = &tb;
+	ret = xleaf_call(tb.mbx, XRT_MAILBOX_LISTEN, &listen);
+	if (ret)
+		goto done;
+
+	n += scnprintf(buf + n, PAGE_SIZE - n, "%8s %5s %8s %10s %10s %10s %8s\n",
+		       "size", "conc", "count", "msgs/s", "p50(us)", "p99(us)", "errors");
+	for (i = 0; i < ARRAY_SIZE(xrt_test_bench_sizes) && ret >= 0; i++) {
+		tb.size = xrt_test_bench_sizes[i];
+		for (j = 0; j < ARRAY_SIZE(xrt_test_bench_concs); j++) {
+			ret = xrt_test_bench_run(&tb, xrt_test_bench_concs[j],
+						 buf + n, PAGE_SIZE - n);
+			if (ret < 0)
+				break;
+			n += ret;
+		}
+	}
+
+	listen.xmil_cb = listen.xmil_prev_cb;
+	listen.xmil_cb_arg = listen.xmil_prev_cb_arg;
+	(void)xleaf_call(tb.mbx, XRT_MAILBOX_LISTEN, &listen);
+	if (ret > 0)
+		ret = 0;
+
+done:
+	vfree(tb.lat);
+	xleaf_put_leaf(pdev, tb.mbx);
+	return ret;
+}
+
+static ssize_t mailbox_bench_show(struct device *dev,
+				  struct device_attribute *da, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct xrt_test *xt = platform_get_drvdata(pdev);
+	ssize_t ret;
+
+	mutex_lock(&xrt_test_bench_lock);
+	ret = sprintf(buf, "%s", xt->bench_result);
+	mutex_unlock(&xrt_test_bench_lock);
+	return ret;
+}
+
+/*
+ * Write number of requests for each point of the sweep to kick off benchmark,
+ * read back result once it is done.
+ */
+static ssize_t mailbox_bench_store(struct device *dev,
+				   struct device_attribute *da,
+				   const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct xrt_test *xt = platform_get_drvdata(pdev);
+	u32 cnt;
+	int ret;
+
+	if (kstrtou32(buf, 10, &cnt) || !cnt || cnt > XRT_TEST_BENCH_MAX_CNT)
+		return -EINVAL;
+
+	mutex_lock(&xrt_test_bench_lock);
+	xt->bench_result[0] = '\0';
+	ret = xrt_test_bench(xt, cnt);
+	mutex_unlock(&xrt_test_bench_lock);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(mailbox_bench);
+
 static struct attribute *xrt_test_attrs[] = {
 	&dev_attr_hold.attr,
 	&dev_attr_release.attr,
+	&dev_attr_mailbox_bench.attr,
 	NULL,
 };
 
@@ -140,6 +362,9 @@ static int xrt_test_probe(struct platform_device *pdev)
 		return -ENOMEM;
 
 	xt->pdev = pdev;
+	xt->bench_result = devm_kzalloc(DEV(pdev), PAGE_SIZE, GFP_KERNEL);
+	if (!xt->bench_result)
+		return -ENOMEM;
 	platform_set_drvdata(pdev, xt);
 
 	/* Ready to handle req thru sysfs nodes. */
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ *  Copyright (C) 2021, Xilinx Inc
+ *
+ */
+
+/**
+ * DOC: Asynchronous flash programming interface
+ * Interfaces exposed by flash device node of xrt_qspi driver, in addition to
+ * plain read() and write().
+ *
+ * A flash job programs images onto flash in the background. Each image is
+ * either copied in from user buffer at submission or read from an opened file
+ * while the job is running. On cards with more than one flash device, one job
+ * can carry one image per device, and the images are programmed in parallel:
+ * while one device is busy erasing or programming, the other one is fed.
+ * As with read() and write(), the flash device is selected by the top byte
+ * of the offset. Only one job can run at a time on a flash controller, and
+ * none while write() is in progress, and vice versa. Completion is signaled
+ * by POLLIN on the flash device node. Closing the node cancels the running
+ * job.
+ *
+ * The flash device node can also be mmap'ed read-only, with file offset being
+ * flash offset as in read(). The mapping is backed by driver's flash page cache
+ * and always reflects current flash content. The cache is off by default, mmap
+ * fails with EOPNOTSUPP until it is sized through cache_size sysfs node.
+ *
+ * =========== ============================== ==================================
+ * Functionality           ioctl request code           data format
+ * =========== ============================== ==================================
+ * 1 Submit job            XRT_FLASH_IOC_JOB_SUBMIT     xrt_flash_ioc_job
+ * 2 Query job status      XRT_FLASH_IOC_JOB_STATUS     xrt_flash_ioc_job_status
+ * 3 Cancel running job    XRT_FLASH_IOC_JOB_CANCEL     none
+ * =========== ============================== ==================================
+ */
+
+#ifndef _XRT_FLASH_IOCTL_H_
+#define _XRT_FLASH_IOCTL_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define XRT_FLASH_IOC_MAGIC		'F'
+#define XRT_FLASH_IOC_JOB_SUBMIT_NR	0x1
+#define XRT_FLASH_IOC_JOB_STATUS_NR	0x2
+#define XRT_FLASH_IOC_JOB_CANCEL_NR	0x3
+
+/* Read back and compare each erase unit after it is programmed. */
+#define XRT_FLASH_JOB_VERIFY		(1 << 0)
+
+#define XRT_FLASH_JOB_MAX_IMAGES	2
+
+/**
+ * struct xrt_flash_ioc_image - one image of a flash job
+ *
+ * @xfi_buf:	Pointer to user's image in memory, used when @xfi_fd is negative
+ * @xfi_fd:	Opened file to read image from, starting at file offset 0, it
+ *		must be opened for reading
+ * @xfi_reserved:	Must be zero
+ * @xfi_size:	Number of bytes to program
+ * @xfi_offset:	Flash offset to program at, top byte selects flash device
+ */
+struct xrt_flash_ioc_image {
+	__u64 xfi_buf;
+	__s32 xfi_fd;
+	__u32 xfi_reserved;
+	__u64 xfi_size;
+	__u64 xfi_offset;
+};
+
+/**
+ * struct xrt_flash_ioc_job - flash job to be submitted
+ * used with XRT_FLASH_IOC_JOB_SUBMIT ioctl
+ *
+ * @xfj_flags:		XRT_FLASH_JOB_* flags
+ * @xfj_num_images:	Number of valid entries in @xfj_images, each of them
+ *			should be on a different flash device
+ * @xfj_images:		Images to program
+ */
+struct xrt_flash_ioc_job {
+	__u32 xfj_flags;
+	__u32 xfj_num_images;
+	struct xrt_flash_ioc_image xfj_images[XRT_FLASH_JOB_MAX_IMAGES];
+};
+
+enum xrt_flash_job_state {
+	XRT_FLASH_JOB_IDLE = 0,
+	XRT_FLASH_JOB_RUNNING,
+	XRT_FLASH_JOB_DONE,
+	XRT_FLASH_JOB_FAILED,
+	XRT_FLASH_JOB_CANCELLED,
+};
+
+/**
+ * struct xrt_flash_ioc_job_status - status of last submitted flash job
+ * used with XRT_FLASH_IOC_JOB_STATUS ioctl
+ *
+ * @xfjs_state:		enum xrt_flash_job_state
+ * @xfjs_error:		Negative errno if job failed
+ * @xfjs_size:		Total number of bytes to program of all images
+ * @xfjs_erased:	Bytes done with erase, including those needing no erase
+ * @xfjs_programmed:	Bytes done with program
+ * @xfjs_verified:	Bytes verified, only when XRT_FLASH_JOB_VERIFY is set
+ * @xfjs_elapsed_ms:	Time spent on the job so far
+ */
+struct xrt_flash_ioc_job_status {
+	__u32 xfjs_state;
+	__s32 xfjs_error;
+	__u64 xfjs_size;
+	__u64 xfjs_erased;
+	__u64 xfjs_programmed;
+	__u64 xfjs_verified;
+	__u64 xfjs_elapsed_ms;
+};
+
+#define XRT_FLASH_IOC_JOB_SUBMIT					\
+	_IOW(XRT_FLASH_IOC_MAGIC, XRT_FLASH_IOC_JOB_SUBMIT_NR, struct xrt_flash_ioc_job)
+#define XRT_FLASH_IOC_JOB_STATUS					\
+	_IOR(XRT_FLASH_IOC_MAGIC, XRT_FLASH_IOC_JOB_STATUS_NR, struct xrt_flash_ioc_job_status)
+#define XRT_FLASH_IOC_JOB_CANCEL					\
+	_IO(XRT_FLASH_IOC_MAGIC, XRT_FLASH_IOC_JOB_CANCEL_NR)
+
+#endif
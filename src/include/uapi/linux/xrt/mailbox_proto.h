@@ -312,17 +312,23 @@ struct xcl_mailbox_peer_data {
  * @paddr: physical address of the verification data buffer
  * @crc32: CRC value of the verification data buffer
  * @version: protocol version supported by peer
+ * @conn_flags: XCL_MB_PEER_* features supported by peer, not sent by old peer
  */
 struct xcl_mailbox_conn {
 	uint64_t kaddr;
 	uint64_t paddr;
 	uint32_t crc32;
 	uint32_t version;
+	uint64_t conn_flags;
 };
 
 #define XCL_COMM_ID_SIZE		2048
 #define XCL_MB_PEER_READY		BIT(0)
 #define XCL_MB_PEER_SAME_DOMAIN		BIT(1)
+#define XCL_MB_PEER_PKT_STREAM		BIT(2)
+#define XCL_MB_PEER_BUSY_NACK		BIT(3)
+#define XCL_MB_PEER_MSG_COMPRESS	BIT(4)
+#define XCL_MB_PEER_MSG_STRIPE		BIT(5)
 /**
  * struct mailbox_conn_resp - MAILBOX_REQ_USER_PROBE response payload type
  * @version: protocol version should be used
@@ -35,6 +35,75 @@ struct xcl_sw_chan {
 	char data[1]; /* variable length of payload */
 };
 
+/*
+ * Multiple msgs can be passed in one read() or write() call as records placed
+ * back to back. Each record is a struct xcl_sw_chan followed by its payload and
+ * the next record starts XCL_SW_CHAN_REC_SIZE() bytes after the current one.
+ * Byte count returned by read() or write() does not include padding after the
+ * last record. The driver returns only one record per read() unless daemon has
+ * turned on XCL_SW_CHAN_CTRL_BATCH_READ.
+ *
+ * A record with zero @id is a control record, which carries no payload. Its
+ * @flags is the new set of XCL_SW_CHAN_CTRL_* settings for the opened device.
+ */
+#define XCL_SW_CHAN_REC_SIZE(sz)	\
+	((sizeof(struct xcl_sw_chan) + (sz) + 7) & ~(uint64_t)7)
+#define XCL_SW_CHAN_CTRL_BATCH_READ	BIT(0)
+
+/**
+ * struct xcl_sw_chan_ring - a ring of fixed size slots in mailbox software
+ *                  channel shared memory. Each slot holds one message framed
+ *                  by struct xcl_sw_chan. The producer only updates @head and
+ *                  the consumer only updates @tail after it is done with the
+ *                  slot. Both are free running counters, slot index is
+ *                  counter % @num_slots. Ring is empty when @head == @tail.
+ * @num_slots: number of slots in this ring
+ * @slot_size: size of one slot in bytes, including struct xcl_sw_chan
+ * @slot_offset: offset of the first slot from beginning of shared memory
+ * @head: counter of slots produced
+ * @tail: counter of slots consumed
+ */
+struct xcl_sw_chan_ring {
+	uint32_t num_slots;
+	uint32_t slot_size;
+	uint64_t slot_offset;
+	uint32_t head;
+	uint32_t reserved0[15];	/* keep head and tail in separate cache lines */
+	uint32_t tail;
+	uint32_t reserved1[15];
+};
+
+/**
+ * struct xcl_sw_chan_shm - mailbox software channel shared memory layout.
+ *                  Daemon (MPD or MSD) can mmap() XCL_SW_CHAN_SHM_SIZE bytes
+ *                  at offset 0 of mailbox device node to get it. Messages
+ *                  fitting in a slot will then be passed through the rings
+ *                  instead of read() and write(). Bigger ones still go through
+ *                  read() and write(). Driver wakes up poll() with POLLIN when
+ *                  @tx has new slots and with POLLOUT when @rx has free slots
+ *                  or more msgs can be written.
+ *                  After producing into @rx or consuming from @tx, daemon
+ *                  should call poll() so that driver can pick up the change.
+ * @version: layout version, XCL_SW_CHAN_SHM_VERSION
+ * @size: total size of shared memory
+ * @tx: msgs from driver to daemon, to be sent to peer
+ * @rx: msgs from daemon to driver, received from peer
+ */
+struct xcl_sw_chan_shm {
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t size;
+	struct xcl_sw_chan_ring tx;
+	struct xcl_sw_chan_ring rx;
+};
+
+#define XCL_SW_CHAN_SHM_VERSION		1
+#define XCL_SW_CHAN_SHM_HDR_SIZE	4096
+#define XCL_SW_CHAN_RING_NUM_SLOTS	64
+#define XCL_SW_CHAN_RING_SLOT_SIZE	4096
+#define XCL_SW_CHAN_SHM_SIZE		(XCL_SW_CHAN_SHM_HDR_SIZE + \
+	2 * XCL_SW_CHAN_RING_NUM_SLOTS * XCL_SW_CHAN_RING_SLOT_SIZE)
+
 /**
  * A packet transport by mailbox hardware channel.
  * When extending, only add new data structure to body. Choose to add new flag
@@ -52,6 +121,15 @@ enum packet_type {
 /* Lower 8 bits for type, the rest for flags. Total packet size is 64 bytes */
 #define PKT_TYPE_MASK		0xff
 #define PKT_TYPE_MSG_END	BIT(31)
+/*
+ * Version 2 packet carries ID of the stream it belongs to, so that msgs on
+ * different streams can be interleaved. Packet without PKT_TYPE_STREAM belongs
+ * to stream 0. Only sent after peer has agreed on it (XCL_MB_PEER_PKT_STREAM).
+ */
+#define PKT_TYPE_STREAM		BIT(30)
+#define PKT_STREAM_SHIFT	8
+#define PKT_STREAM_MASK		(0xf << PKT_STREAM_SHIFT)
+#define PKT_STREAM_NUM		16
 struct mailbox_pkt {
 	struct {
 		u32		type;